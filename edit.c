@@ -7,23 +7,95 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 /*** defines ***/
 
 #define EDIT_VERSION "0.0.1"
 #define EDIT_TAB_STOP 8
 #define EDIT_QUIT_TIMES 3
+#define EDIT_MESSAGE_SECS 5
+#define EDIT_KEY_TIMEOUT 100 // ms to wait for the rest of an escape sequence
+#define EDIT_TICK_MS 100		 // progress refresh while a save runs
+#define EDIT_OPEN_BATCH 1024
+#define EDIT_ROPE_LEAF 512
+#define EDIT_ROPE_MIN_ROWS 65536
+#define EDIT_GAP_MIN 64
+#define EDIT_FIND_MAX_ROWS (1 << 20)
+#define EDIT_FIND_CHUNK 4096
+#define EDIT_FIND_THREADS 8
+#define EDIT_REGEX_STATES 1024
+#define EDIT_SAVE_IOV 1024
+#define EDIT_SAVE_RANGES 16
+#define EDIT_SAVE_CHUNK (1 << 20)
+#define EDIT_UNDO_BYTES (4 << 20)
+#define EDIT_HEAP_SLAB (64 << 10)
+#define EDIT_HEAP_CLASSES 9 // 16-byte blocks up to 4 KB
+#define EDIT_ROW_INLINE 16	 // bytes of text an erow can hold itself
+#define EDIT_INPUT_RING 4096 // a power of two
+#define EDIT_HUGE_BYTES (1LL << 30) // files this big open read-only in huge mode
+#define EDIT_HUGE_STRIDE 1024				// lines per offset checkpoint
+#define EDIT_HUGE_CACHE 4096				// decoded rows kept, a power of two
+#define EDIT_HUGE_PUBLISH (1 << 16)	// lines indexed between updates
+#define EDIT_LOAD_BYTES (16 << 20)	// files this big load in the background
+#define EDIT_LOAD_BATCH (1 << 16)		// lines handed over at a time
+#define EDIT_LOAD_QUEUE 4						// batches the loader may run ahead
+#define EDIT_FOLLOW_MS 50						// least time between reads in follow mode
+#define EDIT_FOLLOW_MAX (8 << 20)		// bytes read per follow tick
+#define EDIT_SCAN_BLOCKS 64					// 32-byte blocks masked per kernel call
+#define EDIT_JOIN_ROW 256						// shorter rows are copied when saving
+#define EDIT_SAVE_JOIN (256 << 10)	// buffer they are copied into
+#define EDIT_RENDER_CACHE 1024			// tab rows keeping a render, a power of two
+#define EDIT_HL_LOOKAHEAD 32				// columns lexed past the screen edge
+#define EDIT_BENCH_ROWS 48					// screen editorBench() draws frames for
+#define EDIT_BENCH_COLS 160
+#define EDIT_PERF_BUCKETS 40				// power-of-two ns buckets per timer, up to ~18 min
+#define EDIT_FRAME_RATE 60					// most frames a second, EDIT_FPS overrides it
+
+/**
+ * Times the rest of the enclosing block into timer id, however it's left
+ * Time spent waiting for keys inside it, as a prompt does, isn't counted
+ */
+#define EDIT_PERF_SCOPE(id) \
+	struct perfScope perf_scope __attribute__((cleanup(editorPerfEnd))) = {id, editorNowNs(), P.waited_ns}
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+#define ROW_MAPPED 1 // chars points into E.map and is not NUL terminated
+#define ROW_GAP 2		 // chars is the gap buffer described by E.gap/E.gaplen
+#define ROW_TABS 4		 // render holds the tab expansion, otherwise it is chars
+#define ROW_NORENDER 8 // render and rsize are not built yet
+#define ROW_DAMAGED 16 // changed since it was last drawn
+#define ROW_SHARED 32	 // chars is owned but also read by the save in progress
+#define ROW_INLINE 64	 // text holds the chars, see editorRowText()
+#define ROW_CACHED 128 // listed in the render cache, see editorRenderCacheAdd()
+#define ROW_COMMENT 256 // ends inside a multi-line comment, see editorHlSync()
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
 enum editorKey
 {
 	BACKSPACE = 127,
@@ -35,25 +107,336 @@ enum editorKey
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_KEY, // start of a bracketed paste, see editorReadPaste()
+	IDLE_KEY	 // no key was pressed, see editorReadKey()
+};
+
+enum editorHighlight
+{
+	HL_NORMAL = 0,
+	HL_COMMENT,
+	HL_MLCOMMENT,
+	HL_KEYWORD1,
+	HL_KEYWORD2,
+	HL_STRING,
+	HL_NUMBER
 };
 
 /*** prototypes ***/
 
+void editorFlattenGap();
+void editorDamageRows(int at);
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+int editorFindBusy();
+void editorPoll();
+int getWindowSize(int *rows, int *cols);
+struct erow;
+void editorRowFreeRender(struct erow *row);
+int editorSaveBusy();
+void editorSaveWait();
+void editorUndoRecord(int op, int row, int at, int c);
+void editorUndoRecordText(int op, int row, int at, char *s, int len);
+size_t editorUndoSize(int len);
+size_t editorUndoLimit();
+void editorLoadStart(size_t from);
+void editorLoadUntil(int rows);
+long long editorNowMs();
+long long editorNowNs();
+struct perfScope;
+void editorPerfEnd(struct perfScope *scope);
+void editorPerfRecord(int id, long long ns);
+char *editorMemFind(const char *h, int hlen, const char *needle, int nlen);
+void editorInitHeadless(int rows, int cols);
+void editorInitBuffer();
 
 /*** data ***/
 
+/**
+ * A row of the buffer, 32 bytes with the fields every scan reads first
+ * Short tab-free rows that aren't mapped keep their chars (and so their
+ * render) in u.text instead of on the heap, see ROW_INLINE
+ * The union is named so the struct stays C99
+ * A tab row's render is preceded by ntabs tabStops, see editorRowTabs()
+ */
 typedef struct erow
 {
 	int size;
 	int rsize;
-	char *chars;
-	char *render;
+	int flags;
+	int ntabs;
+	union
+	{
+		struct
+		{
+			char *chars;
+			char *render;
+		} heap;
+		char text[EDIT_ROW_INLINE];
+	} u;
 } erow;
 
+/**
+ * A tab in a row's chars and the render column just past its expansion
+ */
+struct tabStop
+{
+	int cx;
+	int rx;
+};
+
+/**
+ * Bytes read from the terminal but not parsed into keys yet
+ * head and tail only ever grow, their difference is the fill level
+ */
+struct inputRing
+{
+	char buf[EDIT_INPUT_RING];
+	unsigned head;
+	unsigned tail;
+};
+
+/**
+ * Row storage backend
+ * at() returns the row at an index, splice() opens n uninitialized rows
+ * before an index and remove() drops n rows that were already freed
+ * peek() is at() without side effects, so other threads may call it
+ * while no rows are being added or removed
+ * Row pointers stay valid only until the next splice() or remove()
+ */
+struct rowStore
+{
+	erow *(*at)(int at);
+	erow *(*peek)(int at);
+	void (*splice)(int at, int n);
+	void (*remove)(int at, int n);
+};
+
+/**
+ * Where the last lookup of a huge file's line left off, so the next
+ * line is found without going back to its checkpoint
+ */
+struct hugeCursor
+{
+	int gen; // W.gen it was set for
+	int line;
+	size_t off; // where line starts
+};
+
+/**
+ * A decoded row of a huge file, in the LRU cache
+ */
+struct hugeSlot
+{
+	int line;				// row index it holds
+	int prev, next; // LRU order, most recently used first
+	int hnext;			// next slot in the same hash bucket
+	erow row;
+};
+
+/**
+ * A file mapped read-only, shared by every buffer viewing this version
+ * of it and unmapped when the last one lets go
+ * A huge file's index lives here as well, so a second buffer on it
+ * starts with the lines the indexer already found
+ */
+struct fileMap
+{
+	int refs;
+	char *map;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	size_t *marks; // huge mode only, mark m is the offset of line m * EDIT_HUGE_STRIDE
+	size_t markslen;
+	int lines;			// atomic, lines indexed so far
+	size_t scanned; // atomic, bytes indexed so far
+	int done;				// atomic, set when the indexer returns
+	int cancel;			// atomic
+	pthread_t thread;
+	struct fileMap *next;
+};
+
+/**
+ * A file too big for a row struct per line, viewed read-only
+ * Only a checkpoint every EDIT_HUGE_STRIDE lines stays resident: the
+ * indexer thread leaves them in the fileMap's marks and publishes lines
+ * as it goes, and rows are decoded from the mapping when asked for
+ */
+struct hugeFile
+{
+	int active;
+	int gen; // new for every file opened, so cursors know to start over
+	struct hugeSlot *slots;
+	int *buckets; // 2 * EDIT_HUGE_CACHE chains of slots by line
+	int nslots;
+	int head, tail;
+	struct hugeCursor cursor;
+};
+
+/**
+ * Lines the loader found, in file order, for editorLoadTake() to append
+ */
+struct loadBatch
+{
+	struct loadBatch *next;
+	int n;
+	size_t end; // offset just past the last line
+	size_t off[EDIT_LOAD_BATCH];
+	int len[EDIT_LOAD_BATCH];
+};
+
+/**
+ * The rest of a file editorOpenMapped() left to load in the background
+ * The loader thread only scans the mapping and queues batches of lines;
+ * rows are appended by the main thread as it takes them, so nothing else
+ * ever sees a row store that is changing
+ */
+struct loadState
+{
+	int active;
+	int threaded; // 0 if the loader ran to the end in editorOpenMapped()
+	int exact;		// the rows so far are each exactly their line
+	size_t from;	// where the loader starts
+	size_t covered; // bytes of the file the rows so far hold
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready; // a batch was queued or the loader is done
+	pthread_cond_t room;	// the queue is shorter than EDIT_LOAD_QUEUE
+	struct loadBatch *head, *tail;
+	int queued;
+	int done;				// the last batch is queued
+	int done_exact; // and whether every line the loader found was exact
+	int cancel;
+};
+
+/**
+ * Follow mode, where lines appended to the file show up as they land
+ * inotify wakes the main loop, but new bytes are read at most every
+ * EDIT_FOLLOW_MS, so a busy log costs a frame per tick and not per write
+ */
+struct followState
+{
+	int active;
+	int fd;			// the file, read from off on
+	int ifd;		// inotify instance watching it
+	off_t off;	// bytes of it the rows hold
+	int open;		// the last row is a line without its newline yet
+	int pending; // inotify saw a write that isn't read yet
+	long long due; // editorNowMs() of the earliest next read
+};
+
+struct heapLarge
+{
+	struct heapLarge *prev, *next;
+};
+
+/**
+ * Size-class allocator for row chars and renders
+ * Blocks of 16 << class bytes, each a capacity word and then the data,
+ * are cut from EDIT_HEAP_SLAB slabs and reused through a free list per
+ * class. Bigger requests get their own malloc() on the large list.
+ * Nothing goes back to the system until editorHeapReset() drops it all
+ * Main thread only
+ */
+struct rowHeap
+{
+	size_t *free[EDIT_HEAP_CLASSES];
+	char *bump[EDIT_HEAP_CLASSES], *bump_end[EDIT_HEAP_CLASSES];
+	char **slabs;
+	int nslabs, slabcap;
+	struct heapLarge *large;
+	long nlarge;
+	long blocks; // live blocks, small and large
+};
+
+typedef struct ropeNode
+{
+	struct ropeNode *left, *right;
+	unsigned int prio;
+	int count;
+	int nrows;
+	erow rows[EDIT_ROPE_LEAF];
+} ropeNode;
+
+/**
+ * Rows [lo, hi) changed since the file was last loaded or saved
+ * An empty range marks where rows were only deleted
+ */
+struct rowRange
+{
+	int lo, hi;
+};
+
+struct saveRow
+{
+	char *chars;
+	int size;
+	char text[EDIT_ROW_INLINE]; // a copy of an inline row, chars points here
+};
+
+/**
+ * One instruction set's byte kernels, see editorPickKernels()
+ * count() returns how many of the n bytes at s equal c
+ * masks() sets out[i] to a bit for each byte equal to c in the i-th
+ * 32-byte block of s, n being at most EDIT_SCAN_BLOCKS * 32 and the
+ * bits past the end clear
+ * join() copies rows shorter than EDIT_JOIN_ROW, each with a newline,
+ * while they fit in room, returning how many it took and setting *len
+ * to the bytes written
+ */
+struct byteKernels
+{
+	const char *name;
+	size_t (*count)(const char *s, size_t n, int c);
+	void (*masks)(const char *s, size_t n, int c, uint32_t *out);
+	int (*join)(char *dst, size_t room, struct saveRow *rows, int n, size_t *len);
+};
+
+/**
+ * A full save running on its own thread
+ * The writer only reads rows, a snapshot of the buffer taken when the
+ * save started, and the chars they point to stay as they are until it
+ * is done: mapped chars never change, and an edited ROW_SHARED row
+ * gets a copy while its old chars wait in orphans
+ */
+struct saveState
+{
+	pthread_t thread;
+	int running;
+	struct saveRow *rows;
+	int nrows;
+	char *path;
+	mode_t mode; // for a file that doesn't exist yet
+	int dirty;	 // E.dirty when the snapshot was taken
+	long long total;
+	long long written; // atomic, updated by the writer as it goes
+	int done;					 // atomic, set by the writer when it returns
+	int err;					 // errno the save failed with, or 0
+	char **orphans;
+	int norphans, orphancap;
+	int percent; // last progress shown
+	long long started;
+};
+
+/**
+ * How to highlight one kind of file
+ * Keywords ending in '|' are highlighted as types (HL_KEYWORD2)
+ */
+struct editorSyntax
+{
+	char *filetype;
+	char **filematch;
+	char **keywords;
+	char *singleline_comment_start;
+	char *multiline_comment_start;
+	char *multiline_comment_end;
+	int flags;
+};
+
 struct editorConfig
 {
 	int cx, cy;
@@ -63,505 +446,5977 @@ struct editorConfig
 	int screenrows;
 	int screencols;
 	int numrows;
+	struct rowStore *store;
+	int rowcap;
 	erow *row;
+	ropeNode *rope;
+	long rope_nodes;
+	ropeNode *rope_hit;
+	int rope_hit_start;
+	int gaprow;
+	int gap, gaplen;
 	int dirty;
+	struct rowRange dirty_rows[EDIT_SAVE_RANGES + 1]; // sorted, never touching
+	int ndirty;
 	char *filename;
+	char *map;
+	size_t maplen;
+	struct fileMap *mapping; // map comes from it, or is NULL
+	int map_exact; // the rows with a newline each are the mapping byte for byte
+	dev_t map_dev;
+	ino_t map_ino;
+	struct timespec map_mtime;
+	struct abuf *shadow;
+	struct abuf *out;
+	struct abuf *line;
+	struct editorSyntax *syntax;
+	int hl_rows;			 // rows whose ROW_COMMENT is known, from the top
+	int hl_lo, hl_hi;	 // rows edited since editorHlSync(), none while lo is INT_MAX
+	unsigned char *hl; // classes of the row being drawn
+	char *hl_text;		 // the gap row's chars, closed up for the lexer
+	int hl_cap;
+	int drawn_rows, drawn_cols;
+	int drawn_rowoff, drawn_coloff;
+	int redraw_from;
 	char statusmsg[80];
 	time_t statusmsg_time;
+	int wake[2]; // self-pipe that ends the main loop's wait, see editorWake()
+	volatile sig_atomic_t winch;
 	struct termios orig_termios;
 };
 
-struct editorConfig E;
-
-/*** terminal ***/
+enum undoOp
+{
+	UNDO_INSERT, // text typed at row, at
+	UNDO_DELETE, // text deleted forwards from at
+	UNDO_ERASE,	 // text deleted backwards down to at, stored last char first
+	UNDO_SPLIT,	 // row split at at by a newline
+	UNDO_JOIN,	 // row + 1 appended to row, which was at long
+	UNDO_ROW,		 // row inserted at row, holding the text if there is any
+	UNDO_CHAIN = 0x100 // flag: undone and redone along with the record before
+};
 
 /**
- * Error handling function that cleans up the terminal and exits
- * Called when fatal errors occur (file operations, terminal operations)
- * Clears screen, resets cursor position, prints error message and exits
+ * One change in the undo log, followed in the arena by its len bytes of
+ * text and then its own size, so the log can be walked either way
  */
-void die(const char *s)
+struct undoRec
 {
-	write(STDOUT_FILENO, "\x1b[2J", 4);
-	write(STDOUT_FILENO, "\x1b[H", 3);
-
-	perror(s);
-	exit(1);
-}
+	int op;
+	int row, at;
+	int len;
+};
 
 /**
- * Restores the terminal to its original settings when the editor exits
- * Called automatically at exit via atexit()
- * Reverts all changes made by enableRawMode()
+ * Undo log of the editing keys, as records packed in one arena
+ * Records [0, top) are applied and can be undone, [top, len) were undone
+ * and can be redone. Typing keeps appending to the record at last, so
+ * a run of keys costs a byte each and undoes in one step. The oldest
+ * steps are dropped to keep the arena within editorUndoLimit()
  */
-void disableRawMode()
+struct undoLog
 {
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
-		die("tcseattr");
-}
+	char *buf;
+	size_t cap;
+	size_t len, top;
+	long last; // offset of the record typing may extend, or -1
+	int applying; // set while undoing so the changes aren't logged
+};
 
 /**
- * Configures terminal for raw mode operation
- * - Disables terminal echo
- * - Disables canonical mode (line buffering)
- * - Disables Ctrl-C and Ctrl-Z signals
- * - Disables Ctrl-S and Ctrl-Q flow control
- * - Configures read timeout settings
+ * The tab rows that were drawn, as a ring of row indices
+ * Listing a row when the ring is full drops the render of the oldest
+ * one not near the viewport, so only about EDIT_RENDER_CACHE rows keep
+ * a tab expansion however far the file is scrolled through. Splicing
+ * rows moves the indices along, unused slots are -1
  */
-void enableRawMode()
+struct renderCache
 {
-	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
-		die("tcgetattr");
-	atexit(disableRawMode);
+	int rows[EDIT_RENDER_CACHE];
+	unsigned next;
+};
 
-	struct termios raw = E.orig_termios;
-	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-	raw.c_oflag &= ~(OPOST);
-	raw.c_cflag |= (CS8);
-	// turning off ICANON makes the terminal read character by character instead of the default line by line
-	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+enum perfTimerId
+{
+	PERF_REFRESH,		 // editorRefreshScreen()
+	PERF_KEY,				 // editorProcessKeypress(), from the key arriving
+	PERF_OPEN,			 // editorOpen()
+	PERF_SAVE,			 // editorSave(), the main thread's part
+	PERF_SAVE_WRITE, // a background save, from its start to editorSaveFinish()
+	PERF_FIND,			 // a search level, from editorFindStart() to done
+	PERF_TIMERS
+};
 
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
-		die("tcsetattr");
-}
+const char *PERF_NAMES[PERF_TIMERS] = {"refresh", "key", "open", "save", "save_write", "find"};
 
 /**
- * Reads a keypress from the terminal
- * Handles escape sequences for special keys (arrows, home, end, etc)
- * Returns either a single character or a special key code from editorKey enum
- * Blocks until a key is read
+ * Calls of one timed path, with a histogram of how long they took:
+ * bucket i counts those of 2^i to 2^(i+1) ns
  */
-int editorReadKey()
+struct perfTimer
 {
-	int nread;
-	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
-	{
-		if (nread == -1 && errno != EAGAIN)
-			die("read");
-	}
+	long long count;
+	long long total_ns, max_ns, last_ns;
+	long long buckets[EDIT_PERF_BUCKETS];
+};
 
-	if (c == '\x1b')
-	{
-		char seq[3];
-		if (read(STDIN_FILENO, &seq[0], 1) != 1)
-			return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1)
-			return '\x1b';
-		if (seq[0] == '[')
-		{
-			if (seq[1] >= '0' && seq[1] <= '9')
-			{
-				if (read(STDIN_FILENO, &seq[2], 1) != 1)
-					return '\x1b';
-				if (seq[2] == '~')
-				{
-					switch (seq[1])
-					{
-					case '1':
-						return HOME_KEY;
-					case '3':
-						return DEL_KEY;
-					case '4':
-						return END_KEY;
-					case '5':
-						return PAGE_UP;
-					case '6':
-						return PAGE_DOWN;
-					case '7':
-						return HOME_KEY;
-					case '8':
-						return END_KEY;
-					}
-				}
-			}
-			else
-			{
-				switch (seq[1])
-				{
-				case 'A':
-					return ARROW_UP;
-				case 'B':
-					return ARROW_DOWN;
-				case 'C':
-					return ARROW_RIGHT;
-				case 'D':
-					return ARROW_LEFT;
-				case 'H':
-					return HOME_KEY;
-				case 'F':
-					return END_KEY;
-				}
-			}
-		}
-		else if (seq[0] == 'O')
-		{
-			switch (seq[1])
-			{
-			case 'H':
-				return HOME_KEY;
-			case 'F':
-				return END_KEY;
-			}
-		}
-		return '\x1b';
-	}
-	else
-	{
-		return c;
-	}
-}
+struct perfScope
+{
+	int id;
+	long long start;
+	long long waited; // P.waited_ns at the start
+};
 
-int getCursorPosition(int *rows, int *cols)
+/**
+ * Counters behind the Ctrl-P overlay and the EDIT_PERF_LOG dump
+ * syscalls counts the terminal reads, writes and polls of the main loop,
+ * and per_key divides those since the last frame by the keys since it
+ * Main thread only
+ */
+struct perfState
 {
-	char buf[32];
-	unsigned int i = 0;
-	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
-		return -1;
+	struct perfTimer timers[PERF_TIMERS];
+	int hud;
+	long long syscalls, keys;
+	long long mark_syscalls, mark_keys;
+	double per_key;
+	long long waited_ns;					// in editorReadKey() waiting for input
+	long long frame_bytes, bytes; // the last refresh, all of them
+	long long allocs;							// editorHeapAlloc() calls
+	const char *log;
+};
 
-	while (i < sizeof(buf) - 1)
-	{
-		if (read(STDIN_FILENO, &buf[i], 1) != 1)
-			break;
-		if (buf[i] == 'R')
-			break;
-		i++;
-	}
-	buf[i] = '\0';
+/**
+ * A buffer other than the one being edited: its part of E, and its own
+ * H, U, W, L, T and R, put aside while another buffer's are in place
+ */
+struct editorBuffer
+{
+	struct editorConfig E;
+	struct rowHeap H;
+	struct undoLog U;
+	struct hugeFile W;
+	struct loadState L;
+	struct followState T;
+	struct renderCache R;
+};
 
-	if (buf[0] != '\x1b' || buf[1] != '[')
-		return -1;
-	if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
-		return -1;
+/**
+ * The open buffers, in the order they were opened, and the mappings
+ * they share
+ * buffers[current] is out of date while its state is in the globals
+ */
+struct bufferList
+{
+	struct editorBuffer *buffers;
+	int n, cap;
+	int current;
+	struct fileMap *maps;
+};
 
-	return 0;
-}
+/**
+ * When the next frame may be drawn, see editorFrame()
+ * interval_ns is 0 when frames aren't capped, sync wraps each frame in
+ * synchronized update escapes so the terminal shows it all at once
+ */
+struct frameState
+{
+	long long interval_ns;
+	long long last_ns; // when the last frame started
+	long long dropped; // frames skipped for input that came in meanwhile
+	int sync;
+};
 
-int getWindowSize(int *rows, int *cols)
+struct editorConfig E;
+struct rowHeap H;
+struct saveState S;
+struct undoLog U;
+struct inputRing K;
+struct hugeFile W;
+struct loadState L;
+struct followState T;
+struct renderCache R;
+struct perfState P;
+struct bufferList V;
+struct frameState D;
+
+enum reOp
 {
-	struct winsize ws;
+	RE_CLASS, // consume a byte in set, then go to x
+	RE_SPLIT, // go to both x and y
+	RE_JMP,
+	RE_BOL, // only passable at the start of the text
+	RE_EOL, // only passable at the end of the text
+	RE_MATCH
+};
 
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+struct reInst
+{
+	int op;
+	int x, y;
+	unsigned char set[32];
+};
+
+/**
+ * A regex compiled to a Thompson NFA program, never changed after
+ * compiling so any number of threads can build DFAs from it
+ */
+struct regex
+{
+	struct reInst *prog;
+	int len;
+	int id; // tells regexes apart even if one is freed and another reuses its address
+	struct regex *rev; // the pattern backwards, matched from the end of the text
+};
+
+struct dfaState
+{
+	int *set; // sorted pcs of the RE_CLASS, RE_EOL and RE_MATCH insts reached
+	int n;
+	int accept;		 // a match ends here
+	int eolaccept; // a match ends here if this is the end of the text
+	int next[256]; // state after each byte, or -1 if not built yet
+};
+
+/**
+ * DFA of a regex, built lazily one transition at a time as text is
+ * scanned, and thrown away whole once it holds EDIT_REGEX_STATES states
+ * An unanchored DFA finds matches starting anywhere, an anchored one
+ * only matches starting where the scan starts
+ */
+struct dfa
+{
+	struct regex *re;
+	int id;
+	int unanchored;
+	struct dfaState *states;
+	int count;
+	int table[EDIT_REGEX_STATES * 2]; // hash of set to state index + 1
+	int start[2];											// start state in mid text [0] or at its start [1], or -1
+	int *mid;													// closure of the start in mid text
+	int nmid;
+	int flushes;
+	int *mark; // closure bookkeeping, one per pc
+	int markgen;
+	int *stack;
+	int *scratch;
+};
+
+/**
+ * What a thread needs to scan rows: the DFAs it built for the regex
+ * being searched for
+ */
+struct findScanner
+{
+	struct dfa rev; // unanchored, of the reversed regex, for finding where matches start
+};
+
+/**
+ * Matching rows of one chunk of a search, as scanned by a worker
+ */
+struct findChunk
+{
+	struct findChunk *next; // in the results queue
+	int index;
+	int *rows;
+	int n;
+	long matches;
+};
+
+/**
+ * A search the workers are running, cut into chunks of EDIT_FIND_CHUNK
+ * candidate rows that each worker claims one at a time
+ */
+struct findJob
+{
+	char *query;
+	int qlen;
+	struct regex *re; // set when query is a regex
+	int *cand;				// rows to scan, or NULL to scan all ncand rows
+	int ncand;
+	int nchunks;
+	int next;		// next chunk to claim
+	int cancel; // set when a newer query replaces this one
+};
+
+/**
+ * Rows containing a query, for extending a search as the query grows
+ * n is -1 when more than EDIT_FIND_MAX_ROWS rows matched and the rows
+ * weren't kept, meaning any row may match
+ * Until done is set, rows only exist as the chunk results collected so far
+ * For a regex query, re is NULL if it doesn't compile
+ */
+struct findLevel
+{
+	char *query;
+	int regex;
+	struct regex *re;
+	struct findScanner scan; // for scans of this level on the main thread
+	int *rows;
+	int n;
+	long matches; // occurrences of query, in the chunks collected so far
+	int done;
+	long long started; // editorNowNs() when the scan began
+	struct findChunk **chunks;
+	int nchunks, chunks_done;
+};
+
+struct findState
+{
+	struct findLevel *levels; // one per prefix of the query, shortest first
+	int depth;
+	int cap;
+	int origin_cy, origin_cx;
+	int match_row, match_off; // last match, as row and cx position
+	int pending; // jump waiting for the top level to finish
+	int active;	 // the search prompt is open
+	int regex;	 // queries are regexes, toggled with Ctrl-R in the prompt
+
+	// worker pool, lock guards job, busy and results
+	int nthreads;
+	int job_level; // level the workers are filling, or -1
+	pthread_mutex_t lock;
+	pthread_cond_t work, idle;
+	struct findJob *job;
+	int busy; // workers inside a chunk of job
+	struct findChunk *results;
+};
+
+struct findState F;
+
+/*** filetypes ***/
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".cc", ".hpp", NULL};
+char *C_HL_keywords[] = {
+		"switch", "if", "while", "for", "break", "continue", "return", "else",
+		"struct", "union", "typedef", "static", "enum", "class", "case", "default",
+		"do", "goto", "sizeof", "extern", "volatile", "const", "inline",
+
+		"int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+		"void|", "short|", "size_t|", NULL};
+
+struct editorSyntax HLDB[] = {
+		{"c",
+		 C_HL_extensions,
+		 C_HL_keywords,
+		 "//", "/*", "*/",
+		 HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+/**
+ * A made-up file for edit --bench, the same on every run
+ * lines and bytes are its size at scale 1, whichever is set
+ */
+struct benchCorpus
+{
+	const char *name;
+	long long lines;
+	long long bytes;
+	const char *query; // what the search benchmark types
+	const char *regex; // and then with Ctrl-R
+};
+
+struct benchCorpus BENCH_CORPORA[] = {
+		{"long_lines.txt", 256, 0, "needle", "needle.*needle"},
+		{"tab_heavy.c", 1000000, 0, "count == 7", "== [7-9].*s"},
+		{"short_lines.txt", 10000000, 0, "zq", "z.*q"},
+		{"log.log", 0, 2LL << 30, "took 99", "took 9\\d"},
+};
+
+#define BENCH_CORPORA_ENTRIES (sizeof(BENCH_CORPORA) / sizeof(BENCH_CORPORA[0]))
+
+/*** kernels ***/
+
+/*
+ * The byte loops behind tab expansion, line counting and saving go
+ * through B, the kernels for the best instruction set the CPU has. Each
+ * set only provides masks() and join(); counting, finding and expanding
+ * are built once on top of the masks.
+ */
+
+/**
+ * Copies n < 16 bytes with two overlapping moves instead of a loop
+ */
+static inline void editorCopySmall(char *d, const char *s, size_t n)
+{
+	if (n >= 8)
 	{
-		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
-			return -1;
-		return getCursorPosition(rows, cols);
+		memcpy(d, s, 8);
+		memcpy(d + n - 8, s + n - 8, 8);
 	}
-	else
+	else if (n >= 4)
 	{
-		*cols = ws.ws_col;
-		*rows = ws.ws_row;
-		return 0;
+		memcpy(d, s, 4);
+		memcpy(d + n - 4, s + n - 4, 4);
+	}
+	else if (n > 0)
+	{
+		d[0] = s[0];
+		d[n / 2] = s[n / 2];
+		d[n - 1] = s[n - 1];
 	}
 }
 
-/*** row operations ***/
+/*
+ * A short last block is read whole when that stays inside its page, as
+ * a read past the end of s can't fault there; otherwise it is read
+ * ending at the last byte, or byte by byte if s is shorter than a block.
+ * Sanitizers would see those reads as out of bounds, so they skip them.
+ */
+#define EDIT_OVERREAD __attribute__((no_sanitize("address", "thread")))
+#define EDIT_IN_PAGE(p) (((uintptr_t)(p)&4095) <= 4096 - 32)
 
-int editorRowCxToRx(erow *row, int cx)
+/**
+ * Masks up to 32 bytes eight at a time in a word, without SIMD
+ */
+uint32_t scalarTail(const char *s, size_t n, int c)
+{
+	const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+	uint64_t cc = 0x0101010101010101ULL * (uint8_t)c;
+	uint32_t m = 0;
+	size_t j = 0;
+	for (; j + 8 <= n; j += 8)
+	{
+		uint64_t v;
+		memcpy(&v, s + j, 8);
+		v ^= cc;
+		// the top bit of each byte that was c, then those bits gathered
+		uint64_t t = ~(((v & low7) + low7) | v | low7);
+		m |= (uint32_t)(((t >> 7) * 0x0102040810204080ULL) >> 56) << j;
+	}
+	for (; j < n; j++)
+		m |= (uint32_t)(s[j] == (char)c) << j;
+	return m;
+}
+
+size_t scalarCount(const char *s, size_t n, int c)
+{
+	size_t count = 0;
+	size_t i;
+	for (i = 0; i < n; i += 32)
+		count += __builtin_popcount(scalarTail(s + i, n - i < 32 ? n - i : 32, c));
+	return count;
+}
+
+void scalarMasks(const char *s, size_t n, int c, uint32_t *out)
 {
-	int rx = 0;
+	size_t i;
+	for (i = 0; i < n; i += 32)
+		*out++ = scalarTail(s + i, n - i < 32 ? n - i : 32, c);
+}
+
+int scalarJoin(char *dst, size_t room, struct saveRow *rows, int n, size_t *len)
+{
+	size_t at = 0;
 	int j;
+	for (j = 0; j < n && rows[j].size < EDIT_JOIN_ROW && at + rows[j].size < room; j++)
+	{
+		memcpy(dst + at, rows[j].chars, rows[j].size);
+		at += rows[j].size;
+		dst[at++] = '\n';
+	}
+	*len = at;
+	return j;
+}
+
+struct byteKernels scalarKernels = {"scalar", scalarCount, scalarMasks, scalarJoin};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+EDIT_OVERREAD __attribute__((target("sse2"))) static inline uint32_t sse2Block(const char *s, __m128i cc)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i *)s);
+	__m128i hi = _mm_loadu_si128((const __m128i *)(s + 16));
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, cc)) |
+				 (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, cc)) << 16;
+}
+
+/*
+ * The counts add up the compares' -1s bytewise, for up to 255 blocks
+ * before a byte could wrap, then sum the bytes with psadbw
+ */
+EDIT_OVERREAD __attribute__((target("sse2"))) size_t sse2Count(const char *s, size_t n, int c)
+{
+	__m128i cc = _mm_set1_epi8(c);
+	__m128i zero = _mm_setzero_si128();
+	size_t count = 0;
+	size_t j = 0;
+	while (j + 16 <= n)
+	{
+		size_t end = n - j > 255 * 16 ? j + 255 * 16 : n;
+		__m128i acc = zero;
+		for (; j + 16 <= end; j += 16)
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + j)), cc));
+		__m128i sum = _mm_sad_epu8(acc, zero);
+		count += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+	}
+	if (j < n && EDIT_IN_PAGE(s + j))
+		return count + __builtin_popcount(sse2Block(s + j, cc) & (((uint32_t)1 << (n - j)) - 1));
+	return count + __builtin_popcount(scalarTail(s + j, n - j, c));
+}
+
+EDIT_OVERREAD __attribute__((target("sse2"))) void sse2Masks(const char *s, size_t n, int c,
+																															 uint32_t *out)
+{
+	__m128i cc = _mm_set1_epi8(c);
+	size_t full = n / 32, r = n % 32;
+	size_t i;
+	for (i = 0; i < full; i++)
+		out[i] = sse2Block(s + i * 32, cc);
+	const char *p = s + full * 32;
+	if (r == 0)
+		return;
+	if (EDIT_IN_PAGE(p))
+		out[full] = sse2Block(p, cc) & (((uint32_t)1 << r) - 1);
+	else if (full > 0)
+		out[full] = sse2Block(p + r - 32, cc) >> (32 - r);
+	else
+		out[full] = scalarTail(p, r, c);
+}
 
-	for (j = 0; j < cx; j++)
+__attribute__((target("sse2"))) int sse2Join(char *dst, size_t room, struct saveRow *rows, int n,
+																							size_t *len)
+{
+	size_t at = 0;
+	int j;
+	for (j = 0; j < n && rows[j].size < EDIT_JOIN_ROW && at + rows[j].size < room; j++)
 	{
-		if (row->chars[j] == '\t')
-			rx += (EDIT_TAB_STOP - 1) - (rx % EDIT_TAB_STOP);
-		rx++;
+		const char *s = rows[j].chars;
+		size_t size = rows[j].size;
+		char *d = dst + at;
+		if (size >= 16)
+		{
+			// whole blocks, then one ending at the last byte
+			size_t k;
+			for (k = 0; k + 16 < size; k += 16)
+				_mm_storeu_si128((__m128i *)(d + k), _mm_loadu_si128((const __m128i *)(s + k)));
+			_mm_storeu_si128((__m128i *)(d + size - 16), _mm_loadu_si128((const __m128i *)(s + size - 16)));
+		}
+		else
+			editorCopySmall(d, s, size);
+		at += size;
+		dst[at++] = '\n';
 	}
+	*len = at;
+	return j;
+}
 
-	return rx;
+struct byteKernels sse2Kernels = {"sse2", sse2Count, sse2Masks, sse2Join};
+
+EDIT_OVERREAD __attribute__((target("avx2"))) static inline uint32_t avx2Block(const char *s, __m256i cc)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)s);
+	return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cc));
 }
 
-int editorRowRxToCx(erow *row, int rx)
+EDIT_OVERREAD __attribute__((target("avx2,popcnt"))) size_t avx2Count(const char *s, size_t n, int c)
 {
-	int cur_rx = 0;
-	int cx;
-	for (cx = 0; cx < row->size; cx++)
+	__m256i cc = _mm256_set1_epi8(c);
+	__m256i zero = _mm256_setzero_si256();
+	size_t count = 0;
+	size_t j = 0;
+	while (j + 32 <= n)
 	{
-		if (row->chars[cx] == '\t')
-			cur_rx += (EDIT_TAB_STOP - 1) - (cur_rx % EDIT_TAB_STOP);
-		cur_rx++;
-		if (cur_rx > rx)
-			return cx;
+		size_t end = n - j > 255 * 32 ? j + 255 * 32 : n;
+		__m256i acc = zero;
+		for (; j + 32 <= end; j += 32)
+			acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + j)), cc));
+		__m256i sum = _mm256_sad_epu8(acc, zero);
+		__m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+		count += _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8));
 	}
-	return cx;
+	if (j < n && EDIT_IN_PAGE(s + j))
+		return count + __builtin_popcount(avx2Block(s + j, cc) & (((uint32_t)1 << (n - j)) - 1));
+	return count + __builtin_popcount(scalarTail(s + j, n - j, c));
 }
 
-void editorUpdateRow(erow *row)
+EDIT_OVERREAD __attribute__((target("avx2"))) void avx2Masks(const char *s, size_t n, int c,
+																															 uint32_t *out)
+{
+	__m256i cc = _mm256_set1_epi8(c);
+	size_t full = n / 32, r = n % 32;
+	size_t i;
+	for (i = 0; i < full; i++)
+		out[i] = avx2Block(s + i * 32, cc);
+	const char *p = s + full * 32;
+	if (r == 0)
+		return;
+	if (EDIT_IN_PAGE(p))
+		out[full] = avx2Block(p, cc) & (((uint32_t)1 << r) - 1);
+	else if (full > 0)
+		out[full] = avx2Block(p + r - 32, cc) >> (32 - r);
+	else
+		out[full] = scalarTail(p, r, c);
+}
+
+__attribute__((target("avx2"))) int avx2Join(char *dst, size_t room, struct saveRow *rows, int n,
+																							size_t *len)
 {
-	int tabs = 0;
+	size_t at = 0;
 	int j;
+	for (j = 0; j < n && rows[j].size < EDIT_JOIN_ROW && at + rows[j].size < room; j++)
+	{
+		const char *s = rows[j].chars;
+		size_t size = rows[j].size;
+		char *d = dst + at;
+		if (size >= 32)
+		{
+			size_t k;
+			for (k = 0; k + 32 < size; k += 32)
+				_mm256_storeu_si256((__m256i *)(d + k), _mm256_loadu_si256((const __m256i *)(s + k)));
+			_mm256_storeu_si256((__m256i *)(d + size - 32),
+													_mm256_loadu_si256((const __m256i *)(s + size - 32)));
+		}
+		else if (size >= 16)
+		{
+			_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+			_mm_storeu_si128((__m128i *)(d + size - 16), _mm_loadu_si128((const __m128i *)(s + size - 16)));
+		}
+		else
+			editorCopySmall(d, s, size);
+		at += size;
+		dst[at++] = '\n';
+	}
+	*len = at;
+	return j;
+}
+
+struct byteKernels avx2Kernels = {"avx2", avx2Count, avx2Masks, avx2Join};
+
+#elif defined(__aarch64__)
+
+EDIT_OVERREAD static inline uint32_t neonBlock(const char *s, uint8x16_t cc, uint8x16_t bits)
+{
+	// a bit per lane, summed pairwise down to four bytes of mask
+	uint8x16_t lo = vandq_u8(vceqq_u8(vld1q_u8((const uint8_t *)s), cc), bits);
+	uint8x16_t hi = vandq_u8(vceqq_u8(vld1q_u8((const uint8_t *)(s + 16)), cc), bits);
+	uint8x16_t sum = vpaddq_u8(lo, hi);
+	sum = vpaddq_u8(sum, sum);
+	sum = vpaddq_u8(sum, sum);
+	return vgetq_lane_u32(vreinterpretq_u32_u8(sum), 0);
+}
+
+EDIT_OVERREAD size_t neonCount(const char *s, size_t n, int c)
+{
+	uint8x16_t cc = vdupq_n_u8((uint8_t)c);
+	size_t count = 0;
+	size_t j = 0;
+	while (j + 16 <= n)
+	{
+		size_t end = n - j > 255 * 16 ? j + 255 * 16 : n;
+		uint8x16_t acc = vdupq_n_u8(0);
+		for (; j + 16 <= end; j += 16)
+			acc = vsubq_u8(acc, vceqq_u8(vld1q_u8((const uint8_t *)(s + j)), cc));
+		count += vaddlvq_u8(acc);
+	}
+	if (j < n && EDIT_IN_PAGE(s + j))
+	{
+		static const uint8_t lanes[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+		uint32_t m = neonBlock(s + j, cc, vld1q_u8(lanes));
+		return count + __builtin_popcount(m & (((uint32_t)1 << (n - j)) - 1));
+	}
+	return count + __builtin_popcount(scalarTail(s + j, n - j, c));
+}
 
-	for (j = 0; j < row->size; j++)
-		if (row->chars[j] == '\t')
-			tabs++;
+EDIT_OVERREAD void neonMasks(const char *s, size_t n, int c, uint32_t *out)
+{
+	static const uint8_t lanes[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	uint8x16_t bits = vld1q_u8(lanes);
+	uint8x16_t cc = vdupq_n_u8((uint8_t)c);
+	size_t full = n / 32, r = n % 32;
+	size_t i;
+	for (i = 0; i < full; i++)
+		out[i] = neonBlock(s + i * 32, cc, bits);
+	const char *p = s + full * 32;
+	if (r == 0)
+		return;
+	if (EDIT_IN_PAGE(p))
+		out[full] = neonBlock(p, cc, bits) & (((uint32_t)1 << r) - 1);
+	else if (full > 0)
+		out[full] = neonBlock(p + r - 32, cc, bits) >> (32 - r);
+	else
+		out[full] = scalarTail(p, r, c);
+}
 
-	free(row->render);
-	row->render = malloc(row->size + tabs * (EDIT_TAB_STOP - 1) + 1);
-	int idx = 0;
-	for (j = 0; j < row->size; j++)
+int neonJoin(char *dst, size_t room, struct saveRow *rows, int n, size_t *len)
+{
+	size_t at = 0;
+	int j;
+	for (j = 0; j < n && rows[j].size < EDIT_JOIN_ROW && at + rows[j].size < room; j++)
 	{
-		if (row->chars[j] == '\t')
+		const uint8_t *s = (const uint8_t *)rows[j].chars;
+		size_t size = rows[j].size;
+		uint8_t *d = (uint8_t *)dst + at;
+		if (size >= 16)
 		{
-			row->render[idx++] = ' ';
-			while (idx % EDIT_TAB_STOP != 0)
-				row->render[idx++] = ' ';
+			size_t k;
+			for (k = 0; k + 16 < size; k += 16)
+				vst1q_u8(d + k, vld1q_u8(s + k));
+			vst1q_u8(d + size - 16, vld1q_u8(s + size - 16));
 		}
 		else
+			editorCopySmall((char *)d, (const char *)s, size);
+		at += size;
+		dst[at++] = '\n';
+	}
+	*len = at;
+	return j;
+}
+
+struct byteKernels neonKernels = {"neon", neonCount, neonMasks, neonJoin};
+
+#endif
+
+struct byteKernels *B = &scalarKernels;
+
+/**
+ * Lists the kernel sets this CPU can run, slowest first
+ * Returns how many there are
+ */
+int editorKernelSets(struct byteKernels **sets)
+{
+	int n = 0;
+	sets[n++] = &scalarKernels;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		sets[n++] = &sse2Kernels;
+	if (__builtin_cpu_supports("avx2"))
+		sets[n++] = &avx2Kernels;
+#elif defined(__aarch64__)
+	sets[n++] = &neonKernels;
+#endif
+	return n;
+}
+
+/**
+ * Points B at the fastest kernels, or at the set named by EDIT_KERNELS
+ * in the environment if the CPU has it
+ */
+void editorPickKernels()
+{
+	struct byteKernels *sets[4];
+	int n = editorKernelSets(sets);
+	B = sets[n - 1];
+	char *want = getenv("EDIT_KERNELS");
+	int j;
+	for (j = 0; want && j < n; j++)
+		if (strcmp(want, sets[j]->name) == 0)
+			B = sets[j];
+}
+
+/**
+ * Masks the bytes of s equal to c, one mask per 32 bytes
+ * n is at most EDIT_SCAN_BLOCKS * 32. Returns the number of masks
+ */
+static inline size_t editorByteMasks(const char *s, size_t n, int c, uint32_t *out)
+{
+	B->masks(s, n, c, out);
+	return (n + 31) / 32;
+}
+
+/**
+ * Returns how many bytes of s equal c
+ */
+static inline size_t editorByteCount(const char *s, size_t n, int c)
+{
+	return B->count(s, n, c);
+}
+
+/**
+ * memchr() on the kernels
+ * Masks a couple of blocks first and then twice as many each time, so a
+ * c that is near, as the next tab usually is, costs little
+ */
+const char *editorByteFind(const char *s, size_t n, int c)
+{
+	uint32_t masks[EDIT_SCAN_BLOCKS];
+	size_t at = 0;
+	size_t step = 64;
+	while (at < n)
+	{
+		size_t len = n - at < step ? n - at : step;
+		size_t k = editorByteMasks(s + at, len, c, masks);
+		size_t i;
+		for (i = 0; i < k; i++)
+			if (masks[i])
+				return s + at + i * 32 + __builtin_ctz(masks[i]);
+		at += len;
+		if (step < EDIT_SCAN_BLOCKS * 32)
+			step *= 2;
+	}
+	return NULL;
+}
+
+/**
+ * Skips *k bytes equal to c, as in lines when c is a newline
+ * Chunks with fewer than *k are only counted, the one with the last is
+ * masked to find it. Returns just past the *k-th one, setting *k to 0,
+ * or s + n with *k lowered by the number there were
+ */
+const char *editorByteSkip(const char *s, size_t n, int c, size_t *k)
+{
+	uint32_t masks[EDIT_SCAN_BLOCKS];
+	size_t at = 0;
+	if (*k == 0)
+		return s;
+	while (at < n)
+	{
+		size_t len = n - at < EDIT_SCAN_BLOCKS * 32 ? n - at : EDIT_SCAN_BLOCKS * 32;
+		size_t here = editorByteCount(s + at, len, c);
+		if (here < *k)
+		{
+			*k -= here;
+			at += len;
+			continue;
+		}
+		size_t nm = editorByteMasks(s + at, len, c, masks);
+		size_t i;
+		for (i = 0; i < nm; i++)
+		{
+			size_t bits = __builtin_popcount(masks[i]);
+			if (bits < *k)
+			{
+				*k -= bits;
+				continue;
+			}
+			uint32_t m = masks[i];
+			while (--*k > 0)
+				m &= m - 1;
+			return s + at + i * 32 + __builtin_ctz(m) + 1;
+		}
+		at += len;
+	}
+	return s + n;
+}
+
+/**
+ * Expands the tabs of n chars s into dst from render column rx on
+ * @param cx: Where s starts in its row, for the tab stops
+ * @param stops: Gets a tabStop per tab if not NULL
+ * dst needs room for EDIT_TAB_STOP bytes per tab and one per other char;
+ * the chars between tabs go over in one copy
+ * Returns the render column after them
+ */
+int editorExpandTabs(char *dst, int rx, const char *s, int n, int cx, struct tabStop *stops)
+{
+	uint32_t masks[EDIT_SCAN_BLOCKS];
+	int last = 0; // first char not copied yet
+	int at;
+	for (at = 0; at < n; at += EDIT_SCAN_BLOCKS * 32)
+	{
+		int len = n - at < EDIT_SCAN_BLOCKS * 32 ? n - at : EDIT_SCAN_BLOCKS * 32;
+		size_t k = editorByteMasks(s + at, len, '\t', masks);
+		size_t i;
+		for (i = 0; i < k; i++)
 		{
-			row->render[idx++] = row->chars[j];
+			uint32_t m;
+			for (m = masks[i]; m; m &= m - 1)
+			{
+				int t = at + i * 32 + __builtin_ctz(m);
+				if (t - last < 16)
+					editorCopySmall(dst + rx, s + last, t - last);
+				else
+					memcpy(dst + rx, s + last, t - last);
+				rx += t - last;
+				memset(dst + rx, ' ', EDIT_TAB_STOP);
+				rx += EDIT_TAB_STOP - rx % EDIT_TAB_STOP;
+				if (stops)
+				{
+					stops->cx = cx + t;
+					stops++->rx = rx;
+				}
+				last = t + 1;
+			}
 		}
 	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
+	if (n - last < 16)
+		editorCopySmall(dst + rx, s + last, n - last);
+	else
+		memcpy(dst + rx, s + last, n - last);
+	return rx + n - last;
 }
 
 /**
- * Adds a new row of text to the editor's buffer
- * @param s: The string to add
- * @param len: Length of the string
- * Dynamically allocates memory for the new row
- * Updates the editor's row count
+ * Returns the render column n chars s end at, when they start at rx
  */
-void editorInsertRow(int at, char *s, size_t len)
+int editorSpanRx(const char *s, int n, int rx)
 {
-	if (at < 0 || at > E.numrows)
-		return;
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+	const char *end = s + n;
+	const char *t;
+	while ((t = editorByteFind(s, end - s, '\t')) != NULL)
+	{
+		rx += t - s;
+		rx += EDIT_TAB_STOP - rx % EDIT_TAB_STOP;
+		s = t + 1;
+	}
+	return rx + (end - s);
+}
 
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+/**
+ * Finds which of n chars s, starting at render column *rx, is drawn at
+ * render column target
+ * Returns its index, or n with *rx moved past them if none is
+ */
+int editorSpanCx(const char *s, int n, int *rx, int target)
+{
+	int cx = 0;
+	while (cx < n)
+	{
+		const char *t = editorByteFind(s + cx, n - cx, '\t');
+		int run = t ? t - (s + cx) : n - cx;
+		if (target < *rx + run)
+			return cx + target - *rx;
+		*rx += run;
+		cx += run;
+		if (t == NULL)
+			break;
+		*rx += EDIT_TAB_STOP - *rx % EDIT_TAB_STOP;
+		if (target < *rx)
+			return cx;
+		cx++;
+	}
+	return n;
+}
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	editorUpdateRow(&E.row[at]);
+/**
+ * Times each kernel of every set this CPU runs on a made-up file and
+ * prints the throughput, for edit --bench-kernels
+ */
+int editorBenchKernels()
+{
+	size_t size = 64 << 20;
+	char *text = malloc(size);
+	int nrows = 0;
+	size_t j = 0;
+	unsigned seed = 1;
+	while (j < size)
+	{
+		// lines of 0 to 80 chars, some indented with a tab or two
+		seed = seed * 1103515245 + 12345;
+		size_t len = (seed >> 16) % 81;
+		size_t k;
+		for (k = 0; k < len && j < size; k++, j++)
+			text[j] = k < (seed >> 8) % 3 ? '\t' : 'a' + j % 26;
+		if (j < size)
+			text[j++] = '\n';
+		nrows++;
+	}
+	struct saveRow *rows = malloc(nrows * sizeof(*rows));
+	char *p = text;
+	int r;
+	for (r = 0; r < nrows; r++)
+	{
+		char *nl = memchr(p, '\n', text + size - p);
+		rows[r].chars = p;
+		rows[r].size = (nl ? nl : text + size) - p;
+		p = nl ? nl + 1 : text + size;
+	}
+	size_t tabs = 0;
+	for (j = 0; j < size; j++)
+		tabs += text[j] == '\t';
+	char *dst = malloc(size + tabs * EDIT_TAB_STOP);
+	char *buf = malloc(EDIT_SAVE_JOIN);
 
-	E.numrows++;
-	E.dirty++;
+	struct byteKernels *sets[4];
+	int nsets = editorKernelSets(sets);
+	const char *names[] = {"count tabs", "skip lines", "expand tabs", "render rows", "join rows"};
+	printf("%-12s", "GB/s");
+	int s, t;
+	for (s = 0; s < nsets; s++)
+		printf("%10s", sets[s]->name);
+	printf("\n");
+	for (t = 0; t < 5; t++)
+	{
+		printf("%-12s", names[t]);
+		for (s = 0; s < nsets; s++)
+		{
+			B = sets[s];
+			struct timespec t0, t1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			int reps = 0;
+			double secs;
+			size_t check = 0;
+			do
+			{
+				if (t == 0)
+					check += editorByteCount(text, size, '\t');
+				else if (t == 1)
+				{
+					size_t k = SIZE_MAX;
+					editorByteSkip(text, size, '\n', &k);
+					check += SIZE_MAX - k;
+				}
+				else if (t == 2)
+					check += editorExpandTabs(dst, 0, text, size, 0, NULL);
+				else if (t == 3)
+				{
+					// row by row, as editorUpdateRow() does
+					char *to = dst;
+					for (r = 0; r < nrows; r++)
+					{
+						size_t n = editorByteCount(rows[r].chars, rows[r].size, '\t');
+						to += editorExpandTabs(to, 0, rows[r].chars, rows[r].size, 0, NULL);
+						check += n;
+					}
+				}
+				else
+				{
+					int done = 0;
+					while (done < nrows)
+					{
+						size_t len;
+						done += B->join(buf, EDIT_SAVE_JOIN, rows + done, nrows - done, &len);
+						if (len == 0)
+							done++; // a long row, which goes out as it is
+						check += len;
+					}
+				}
+				reps++;
+				clock_gettime(CLOCK_MONOTONIC, &t1);
+				secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+			} while (secs < 0.25);
+			printf("%10.2f", (double)size * reps / secs / 1e9);
+			if (check == 0)
+				printf("?");
+		}
+		printf("\n");
+	}
+	editorPickKernels();
+	free(text);
+	free(rows);
+	free(dst);
+	free(buf);
+	return 0;
 }
 
-void editorRowInsertChar(erow *row, int at, int c)
+/*** terminal ***/
+
+/**
+ * Error handling function that cleans up the terminal and exits
+ * Called when fatal errors occur (file operations, terminal operations)
+ * Clears screen, resets cursor position, prints error message and exits
+ */
+void die(const char *s)
+{
+	write(STDOUT_FILENO, "\x1b[2J", 4);
+	write(STDOUT_FILENO, "\x1b[H", 3);
+
+	perror(s);
+	exit(1);
+}
+
+/**
+ * Restores the terminal to its original settings when the editor exits
+ * Called automatically at exit via atexit()
+ * Reverts all changes made by enableRawMode()
+ */
+void disableRawMode()
+{
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
+		die("tcseattr");
+}
+
+/**
+ * Configures terminal for raw mode operation
+ * - Disables terminal echo
+ * - Disables canonical mode (line buffering)
+ * - Disables Ctrl-C and Ctrl-Z signals
+ * - Disables Ctrl-S and Ctrl-Q flow control
+ * - Configures read timeout settings, which only matter for reads that
+ *   aren't preceded by a poll(), like getCursorPosition()'s
+ * - Turns on bracketed paste, so pastes arrive as one PASTE_KEY
+ */
+void enableRawMode()
+{
+	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
+		die("tcgetattr");
+	atexit(disableRawMode);
+
+	struct termios raw = E.orig_termios;
+	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	raw.c_oflag &= ~(OPOST);
+	raw.c_cflag |= (CS8);
+	// turning off ICANON makes the terminal read character by character instead of the default line by line
+	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+	raw.c_cc[VMIN] = 0;
+	raw.c_cc[VTIME] = 1;
+
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+		die("tcsetattr");
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/**
+ * Ends the main loop's wait, from any thread or a signal handler
+ * Background workers call it when they have something to show
+ */
+void editorWake()
+{
+	int saved = errno;
+	// fd 0 is the terminal, so it means no pipe was set up
+	if (E.wake[1])
+		write(E.wake[1], "", 1);
+	errno = saved;
+}
+
+void editorHandleWinch(int sig)
+{
+	(void)sig;
+	E.winch = 1;
+	editorWake();
+}
+
+/**
+ * Reads as much terminal input as fits in the ring with one read()
+ * Returns the number of bytes added
+ */
+int editorInputFill()
+{
+	unsigned used = K.tail - K.head;
+	unsigned at = K.tail % EDIT_INPUT_RING;
+	unsigned room = EDIT_INPUT_RING - used;
+	if (room > EDIT_INPUT_RING - at)
+		room = EDIT_INPUT_RING - at;
+	if (room == 0)
+		return 0;
+	ssize_t nread = read(STDIN_FILENO, &K.buf[at], room);
+	P.syscalls++;
+	if (nread == -1 && errno != EAGAIN && errno != EINTR)
+		die("read");
+	if (nread <= 0)
+		return 0;
+	K.tail += nread;
+	return nread;
+}
+
+/**
+ * Sleeps until terminal input arrives or timeout ms pass (-1 for never)
+ * @param wake: Also return on editorWake() or a write to a followed
+ * file, handling a resize if that was the reason
+ * Returns 1 once input was read into the ring, 0 on timeout and -1
+ * when woken
+ */
+int editorInputWait(int timeout, int wake)
+{
+	struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {E.wake[0], POLLIN, 0}, {-1, POLLIN, 0}};
+	// a write already pending is read on the timer, not the next event
+	if (T.active && !T.pending)
+		fds[2].fd = T.ifd;
+	int n = poll(fds, wake && E.wake[0] ? 3 : 1, timeout);
+	P.syscalls++;
+	if (n == -1)
+	{
+		if (errno != EINTR)
+			die("poll");
+		return wake ? -1 : 0;
+	}
+	if (n && fds[0].revents)
+	{
+		if (editorInputFill() > 0)
+			return 1;
+		if (fds[0].revents & POLLHUP)
+			die("read");
+	}
+	if (n && wake && (fds[1].revents & POLLIN))
+	{
+		char buf[64];
+		while (P.syscalls++, read(E.wake[0], buf, sizeof(buf)) > 0)
+			;
+		if (E.winch)
+		{
+			E.winch = 0;
+			int rows, cols;
+			if (getWindowSize(&rows, &cols) != -1)
+			{
+				E.screenrows = rows - 2;
+				E.screencols = cols;
+			}
+		}
+		return -1;
+	}
+	if (n && wake && (fds[2].revents & POLLIN))
+	{
+		char buf[4096];
+		while (P.syscalls++, read(T.ifd, buf, sizeof(buf)) > 0)
+			;
+		T.pending = 1;
+		return -1;
+	}
+	return 0;
+}
+
+long long editorNowMs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long editorNowNs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Returns the ms until the next timer is due, or -1 if none is
+ * The timers are the status message expiring, a running save's progress
+ * and a followed file's next read, so an idle editor sleeps in poll()
+ * until a key arrives
+ */
+int editorNextTimer()
+{
+	int timeout = -1;
+	if (E.statusmsg[0] && E.statusmsg_time)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		long long left = (long long)(E.statusmsg_time + EDIT_MESSAGE_SECS) * 1000 -
+										 ((long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+		if (left > 0)
+			timeout = left < INT_MAX ? left : INT_MAX;
+	}
+	if (editorSaveBusy() && (timeout == -1 || timeout > EDIT_TICK_MS))
+		timeout = EDIT_TICK_MS;
+	// a scan holds follow mode off until it wakes the editor at its end
+	if (T.active && T.pending && !editorFindBusy())
+	{
+		long long left = T.due - editorNowMs();
+		if (left < 0)
+			left = 0;
+		if (timeout == -1 || timeout > left)
+			timeout = left;
+	}
+	return timeout;
+}
+
+/**
+ * Takes the next input byte, reading more only once the ring is empty
+ * Returns 0 if none arrived within EDIT_KEY_TIMEOUT
+ */
+int editorInputByte(int *c)
+{
+	if (K.head == K.tail && editorInputWait(EDIT_KEY_TIMEOUT, 0) != 1)
+		return 0;
+	*c = (unsigned char)K.buf[K.head++ % EDIT_INPUT_RING];
+	return 1;
+}
+
+/**
+ * Returns whether a key can be read without waiting
+ */
+int editorKeyPending()
+{
+	if (K.head != K.tail)
+		return 1;
+	struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+	P.syscalls++;
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/**
+ * Reads a keypress from the terminal
+ * Handles escape sequences for special keys (arrows, home, end, etc)
+ * Returns either a single character or a special key code from editorKey enum
+ * Sleeps until a key is read, or returns IDLE_KEY when a timer is due
+ * or the editor is woken, so the caller polls and redraws: that is how
+ * the prompt collects a search's results while a save, the loader and
+ * follow mode go on, and how a resize takes effect
+ * Keys come out of the input ring, so a burst costs one read() per ring
+ */
+int editorReadKey()
+{
+	int c;
+	while (K.head == K.tail)
+	{
+		long long start = editorNowNs();
+		int got = editorInputWait(editorNextTimer(), 1);
+		P.waited_ns += editorNowNs() - start;
+		if (got != 1)
+			return IDLE_KEY;
+	}
+	c = (unsigned char)K.buf[K.head++ % EDIT_INPUT_RING];
+
+	if (c == '\x1b')
+	{
+		int seq[2];
+		if (!editorInputByte(&seq[0]))
+			return '\x1b';
+		if (!editorInputByte(&seq[1]))
+			return '\x1b';
+		if (seq[0] == '[')
+		{
+			if (seq[1] >= '0' && seq[1] <= '9')
+			{
+				// the whole sequence is consumed, even when it isn't known
+				int num = 0;
+				int end = seq[1];
+				while (end >= '0' && end <= '9')
+				{
+					if (num < 1000)
+						num = num * 10 + end - '0';
+					if (!editorInputByte(&end))
+						return '\x1b';
+				}
+				while (end < 0x40 || end > 0x7e)
+					if (!editorInputByte(&end))
+						return '\x1b';
+				if (end == '~')
+				{
+					switch (num)
+					{
+					case 1:
+						return HOME_KEY;
+					case 3:
+						return DEL_KEY;
+					case 4:
+						return END_KEY;
+					case 5:
+						return PAGE_UP;
+					case 6:
+						return PAGE_DOWN;
+					case 7:
+						return HOME_KEY;
+					case 8:
+						return END_KEY;
+					case 200:
+						return PASTE_KEY;
+					}
+				}
+			}
+			else
+			{
+				switch (seq[1])
+				{
+				case 'A':
+					return ARROW_UP;
+				case 'B':
+					return ARROW_DOWN;
+				case 'C':
+					return ARROW_RIGHT;
+				case 'D':
+					return ARROW_LEFT;
+				case 'H':
+					return HOME_KEY;
+				case 'F':
+					return END_KEY;
+				}
+			}
+		}
+		else if (seq[0] == 'O')
+		{
+			switch (seq[1])
+			{
+			case 'H':
+				return HOME_KEY;
+			case 'F':
+				return END_KEY;
+			}
+		}
+		return '\x1b';
+	}
+	else
+	{
+		return c;
+	}
+}
+
+/**
+ * Reads the text of a bracketed paste, after its PASTE_KEY
+ * @param len: Set to the length of the text
+ * Bytes are taken as they are up to the closing sequence, or until the
+ * terminal goes quiet if it never sends one; the caller frees the text
+ */
+char *editorReadPaste(size_t *len)
+{
+	static const char end[] = "\x1b[201~";
+	size_t cap = 4096;
+	size_t n = 0;
+	char *text = malloc(cap);
+	int c;
+	while (editorInputByte(&c))
+	{
+		if (n == cap)
+		{
+			cap *= 2;
+			text = realloc(text, cap);
+		}
+		text[n++] = c;
+		if (c == '~' && n >= sizeof(end) - 1 && memcmp(&text[n - (sizeof(end) - 1)], end, sizeof(end) - 1) == 0)
+		{
+			n -= sizeof(end) - 1;
+			break;
+		}
+	}
+	*len = n;
+	return text;
+}
+
+int getCursorPosition(int *rows, int *cols)
+{
+	char buf[32];
+	unsigned int i = 0;
+	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+		return -1;
+
+	while (i < sizeof(buf) - 1)
+	{
+		if (read(STDIN_FILENO, &buf[i], 1) != 1)
+			break;
+		if (buf[i] == 'R')
+			break;
+		i++;
+	}
+	buf[i] = '\0';
+
+	if (buf[0] != '\x1b' || buf[1] != '[')
+		return -1;
+	if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+		return -1;
+
+	return 0;
+}
+
+int getWindowSize(int *rows, int *cols)
+{
+	struct winsize ws;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+	{
+		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+			return -1;
+		return getCursorPosition(rows, cols);
+	}
+	else
+	{
+		*cols = ws.ws_col;
+		*rows = ws.ws_row;
+		return 0;
+	}
+}
+
+/*** perf ***/
+
+void editorPerfRecord(int id, long long ns)
+{
+	struct perfTimer *t = &P.timers[id];
+	int b = 63 - __builtin_clzll(ns | 1);
+	t->count++;
+	t->total_ns += ns;
+	t->last_ns = ns;
+	if (ns > t->max_ns)
+		t->max_ns = ns;
+	t->buckets[b < EDIT_PERF_BUCKETS ? b : EDIT_PERF_BUCKETS - 1]++;
+}
+
+/**
+ * Ends an EDIT_PERF_SCOPE(), called as its variable goes out of scope
+ */
+void editorPerfEnd(struct perfScope *scope)
+{
+	editorPerfRecord(scope->id, editorNowNs() - scope->start - (P.waited_ns - scope->waited));
+}
+
+/**
+ * Formats ns as a short duration like 850ns, 12.5us or 1.20s
+ */
+char *editorPerfTime(char *buf, size_t size, long long ns)
+{
+	if (ns < 1000)
+		snprintf(buf, size, "%lldns", ns);
+	else if (ns < 1000000)
+		snprintf(buf, size, "%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf(buf, size, "%.1fms", ns / 1e6);
+	else
+		snprintf(buf, size, "%.2fs", ns / 1e9);
+	return buf;
+}
+
+char *editorPerfBytes(char *buf, size_t size, long long n)
+{
+	if (n < 1024)
+		snprintf(buf, size, "%lldB", n);
+	else if (n < 1 << 20)
+		snprintf(buf, size, "%.1fK", n / 1024.0);
+	else if (n < 1 << 30)
+		snprintf(buf, size, "%.1fM", n / 1048576.0);
+	else
+		snprintf(buf, size, "%.1fG", n / 1073741824.0);
+	return buf;
+}
+
+/**
+ * Bytes held by the row structs, whichever store they are in
+ * The text they point to is counted separately, as the row heap
+ */
+long long editorPerfRowBytes()
+{
+	if (W.active)
+		return E.mapping->markslen * sizeof(size_t) + (long long)W.nslots * sizeof(struct hugeSlot);
+	if (E.rope)
+		return E.rope_nodes * (long long)sizeof(ropeNode);
+	return E.rowcap * (long long)sizeof(erow);
+}
+
+/**
+ * Writes every timer's histogram to EDIT_PERF_LOG, at exit
+ */
+void editorPerfDump()
+{
+	FILE *fp = fopen(P.log, "w");
+	if (!fp)
+		return;
+	char a[16], b[16], c[16];
+	fprintf(fp, "edit perf: %lld keys, %lld syscalls, %lld bytes written in %lld refreshes (%lld dropped), %lld allocs\n",
+					P.keys, P.syscalls, P.bytes, P.timers[PERF_REFRESH].count, D.dropped, P.allocs);
+	int id, i;
+	for (id = 0; id < PERF_TIMERS; id++)
+	{
+		struct perfTimer *t = &P.timers[id];
+		if (t->count == 0)
+			continue;
+		fprintf(fp, "\n%s: %lld calls, total %s, mean %s, max %s\n", PERF_NAMES[id], t->count,
+						editorPerfTime(a, sizeof(a), t->total_ns), editorPerfTime(b, sizeof(b), t->total_ns / t->count),
+						editorPerfTime(c, sizeof(c), t->max_ns));
+		long long top = 0;
+		for (i = 0; i < EDIT_PERF_BUCKETS; i++)
+			if (t->buckets[i] > top)
+				top = t->buckets[i];
+		for (i = 0; i < EDIT_PERF_BUCKETS; i++)
+		{
+			if (t->buckets[i] == 0)
+				continue;
+			fprintf(fp, "  %8s - %-8s %10lld ", editorPerfTime(a, sizeof(a), 1LL << i),
+							editorPerfTime(b, sizeof(b), 2LL << i), t->buckets[i]);
+			int bar = (t->buckets[i] * 40 + top - 1) / top;
+			while (bar--)
+				fputc('#', fp);
+			fputc('\n', fp);
+		}
+	}
+	fclose(fp);
+}
+
+/*** row heap ***/
+
+/**
+ * Returns the class whose blocks hold n bytes of data, or
+ * EDIT_HEAP_CLASSES if n is too big for any
+ */
+int editorHeapClass(size_t n)
+{
+	int c = 0;
+	while (c < EDIT_HEAP_CLASSES && ((size_t)16 << c) - sizeof(size_t) < n)
+		c++;
+	return c;
+}
+
+void *editorHeapAlloc(size_t n)
+{
+	H.blocks++;
+	P.allocs++;
+	int c = editorHeapClass(n);
+	size_t *b;
+	if (c == EDIT_HEAP_CLASSES)
+	{
+		struct heapLarge *l = malloc(sizeof(*l) + sizeof(size_t) + n);
+		l->prev = NULL;
+		l->next = H.large;
+		if (H.large)
+			H.large->prev = l;
+		H.large = l;
+		H.nlarge++;
+		b = (size_t *)(l + 1);
+		*b = n;
+		return b + 1;
+	}
+
+	size_t bs = (size_t)16 << c;
+	if (H.free[c])
+	{
+		b = H.free[c];
+		H.free[c] = *(size_t **)(b + 1);
+	}
+	else
+	{
+		if (H.bump[c] == H.bump_end[c])
+		{
+			if (H.nslabs == H.slabcap)
+			{
+				H.slabcap = H.slabcap ? H.slabcap * 2 : 64;
+				H.slabs = realloc(H.slabs, H.slabcap * sizeof(char *));
+			}
+			H.bump[c] = H.slabs[H.nslabs++] = malloc(EDIT_HEAP_SLAB);
+			H.bump_end[c] = H.bump[c] + EDIT_HEAP_SLAB;
+		}
+		b = (size_t *)H.bump[c];
+		H.bump[c] += bs;
+	}
+	*b = bs - sizeof(size_t);
+	return b + 1;
+}
+
+void editorHeapFree(void *p)
+{
+	if (p == NULL)
+		return;
+	H.blocks--;
+	size_t *b = (size_t *)p - 1;
+	int c = editorHeapClass(*b);
+	if (c == EDIT_HEAP_CLASSES)
+	{
+		struct heapLarge *l = (struct heapLarge *)b - 1;
+		if (l->prev)
+			l->prev->next = l->next;
+		else
+			H.large = l->next;
+		if (l->next)
+			l->next->prev = l->prev;
+		H.nlarge--;
+		free(l);
+		return;
+	}
+	*(size_t **)(b + 1) = H.free[c];
+	H.free[c] = b;
+}
+
+/**
+ * Grows a block to hold n bytes, in place while its class has room
+ */
+void *editorHeapRealloc(void *p, size_t n)
+{
+	if (p == NULL)
+		return editorHeapAlloc(n);
+	size_t cap = ((size_t *)p)[-1];
+	if (n <= cap)
+		return p;
+	void *q = editorHeapAlloc(n);
+	memcpy(q, p, cap);
+	editorHeapFree(p);
+	return q;
+}
+
+/**
+ * Releases every block at once, one free() per slab instead of per row
+ * Only for when no row points into the heap any more
+ */
+void editorHeapReset()
+{
+	while (H.nslabs)
+		free(H.slabs[--H.nslabs]);
+	while (H.large)
+	{
+		struct heapLarge *l = H.large;
+		H.large = l->next;
+		free(l);
+	}
+	int c;
+	for (c = 0; c < EDIT_HEAP_CLASSES; c++)
+		H.free[c] = NULL, H.bump[c] = H.bump_end[c] = NULL;
+	H.nlarge = 0;
+	H.blocks = 0;
+}
+
+/*** row storage ***/
+
+/*
+ * Flat array backend
+ * Rows live in one array, so access is O(1) but inserting or deleting
+ * moves the whole tail. Used until the buffer reaches EDIT_ROPE_MIN_ROWS.
+ */
+
+erow *flatAt(int at)
+{
+	return &E.row[at];
+}
+
+void flatSplice(int at, int n)
+{
+	if (E.numrows + n > E.rowcap)
+	{
+		int cap = E.rowcap ? E.rowcap * 2 : 16;
+		if (cap < E.numrows + n)
+			cap = E.numrows + n;
+		E.row = realloc(E.row, sizeof(erow) * cap);
+		E.rowcap = cap;
+	}
+	memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+}
+
+void flatRemove(int at, int n)
+{
+	memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+}
+
+struct rowStore flatStore = {flatAt, flatAt, flatSplice, flatRemove};
+
+/*
+ * Rope backend
+ * An implicit treap whose nodes each hold a leaf of up to EDIT_ROPE_LEAF
+ * rows, ordered by position and keyed by subtree row counts. Access,
+ * insert and delete of lines are O(log n) plus a memmove inside one leaf.
+ * The last leaf hit is cached so sequential scans don't descend each time.
+ */
+
+unsigned int ropeRand()
+{
+	static unsigned int seed = 2463534242u;
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+int ropeCount(ropeNode *t)
+{
+	return t ? t->count : 0;
+}
+
+void ropeUpdate(ropeNode *t)
+{
+	t->count = ropeCount(t->left) + t->nrows + ropeCount(t->right);
+}
+
+ropeNode *ropeNewNode(erow *rows, int n)
+{
+	ropeNode *t = malloc(sizeof(ropeNode));
+	E.rope_nodes++;
+	t->left = t->right = NULL;
+	t->prio = ropeRand();
+	t->nrows = n;
+	if (rows)
+		memcpy(t->rows, rows, sizeof(erow) * n);
+	ropeUpdate(t);
+	return t;
+}
+
+ropeNode *ropeMerge(ropeNode *a, ropeNode *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (a->prio > b->prio)
+	{
+		a->right = ropeMerge(a->right, b);
+		ropeUpdate(a);
+		return a;
+	}
+	b->left = ropeMerge(a, b->left);
+	ropeUpdate(b);
+	return b;
+}
+
+/**
+ * Splits a rope into the first k rows (*l) and the rest (*r)
+ * A leaf straddling the split point is cut in two
+ */
+void ropeSplit(ropeNode *t, int k, ropeNode **l, ropeNode **r)
+{
+	if (!t)
+	{
+		*l = *r = NULL;
+		return;
+	}
+	int lc = ropeCount(t->left);
+	if (k <= lc)
+	{
+		ropeSplit(t->left, k, l, &t->left);
+		ropeUpdate(t);
+		*r = t;
+	}
+	else if (k >= lc + t->nrows)
+	{
+		ropeSplit(t->right, k - lc - t->nrows, &t->right, r);
+		ropeUpdate(t);
+		*l = t;
+	}
+	else
+	{
+		int j = k - lc;
+		ropeNode *tail = ropeNewNode(&t->rows[j], t->nrows - j);
+		ropeNode *right = t->right;
+		t->nrows = j;
+		t->right = NULL;
+		ropeUpdate(t);
+		*l = t;
+		*r = ropeMerge(tail, right);
+	}
+}
+
+void ropeFreeTree(ropeNode *t)
+{
+	if (!t)
+		return;
+	ropeFreeTree(t->left);
+	ropeFreeTree(t->right);
+	free(t);
+	E.rope_nodes--;
+}
+
+/**
+ * Finds the leaf holding position at
+ * @param start: Set to the index of the leaf's first row
+ * @param delta: Added to the row count of every node on the way down
+ * With insert set, a position on a leaf boundary (or at the very end)
+ * resolves to the leaf that ends there so rows can be appended to it
+ */
+ropeNode *ropeFind(int at, int *start, int delta, int insert)
+{
+	ropeNode *t = E.rope;
+	int base = 0;
+	while (t)
+	{
+		if (delta)
+			t->count += delta;
+		int lc = ropeCount(t->left);
+		if (at - base < lc)
+		{
+			t = t->left;
+			continue;
+		}
+		int j = at - base - lc;
+		if (j < t->nrows || (insert && j == t->nrows))
+		{
+			*start = base + lc;
+			return t;
+		}
+		base += lc + t->nrows;
+		t = t->right;
+	}
+	return NULL;
+}
+
+erow *ropeAt(int at)
+{
+	ropeNode *t = E.rope_hit;
+	if (!t || at < E.rope_hit_start || at >= E.rope_hit_start + t->nrows)
+	{
+		t = ropeFind(at, &E.rope_hit_start, 0, 0);
+		E.rope_hit = t;
+	}
+	return &t->rows[at - E.rope_hit_start];
+}
+
+/**
+ * ropeAt() without the hit cache, for lookups from other threads
+ */
+erow *ropePeek(int at)
+{
+	int start = 0;
+	ropeNode *t = ropeFind(at, &start, 0, 0);
+	return &t->rows[at - start];
+}
+
+void ropeSplice(int at, int n)
+{
+	ropeNode *l, *r;
+	int start;
+	E.rope_hit = NULL;
+
+	if (n <= EDIT_ROPE_LEAF / 2 && E.rope)
+	{
+		ropeNode *t = ropeFind(at, &start, 0, 1);
+		while (t->nrows + n > EDIT_ROPE_LEAF)
+		{
+			// full leaf: cut it in half, then look again since a position on
+			// a leaf boundary may now resolve to the neighbouring leaf
+			ropeSplit(E.rope, start + t->nrows / 2, &l, &r);
+			E.rope = ropeMerge(l, r);
+			t = ropeFind(at, &start, 0, 1);
+		}
+		t = ropeFind(at, &start, n, 1);
+		int j = at - start;
+		memmove(&t->rows[j + n], &t->rows[j], sizeof(erow) * (t->nrows - j));
+		t->nrows += n;
+		return;
+	}
+
+	ropeNode *mid = NULL;
+	while (n > 0)
+	{
+		int m = n < EDIT_ROPE_LEAF ? n : EDIT_ROPE_LEAF;
+		mid = ropeMerge(mid, ropeNewNode(NULL, m));
+		n -= m;
+	}
+	ropeSplit(E.rope, at, &l, &r);
+	E.rope = ropeMerge(ropeMerge(l, mid), r);
+}
+
+void ropeRemove(int at, int n)
+{
+	ropeNode *l, *mid, *r;
+	int start;
+	E.rope_hit = NULL;
+
+	ropeNode *t = ropeFind(at, &start, 0, 0);
+	if (at + n <= start + t->nrows && t->nrows > n)
+	{
+		t = ropeFind(at, &start, -n, 0);
+		int j = at - start;
+		memmove(&t->rows[j], &t->rows[j + n], sizeof(erow) * (t->nrows - j - n));
+		t->nrows -= n;
+		return;
+	}
+
+	ropeSplit(E.rope, at, &l, &r);
+	ropeSplit(r, n, &mid, &r);
+	ropeFreeTree(mid);
+	E.rope = ropeMerge(l, r);
+}
+
+struct rowStore ropeStore = {ropeAt, ropePeek, ropeSplice, ropeRemove};
+
+/*
+ * Huge file backend
+ * Rows of a file opened in huge mode, decoded from the mapping on demand.
+ * at() keeps the last EDIT_HUGE_CACHE rows it decoded, so a row pointer
+ * stays good until that many other rows have been asked for. The buffer
+ * is read-only, so rows are never spliced in and only removed on close.
+ */
+
+/**
+ * Fills in row for line at, walking from where the cursor stopped, or
+ * from the line's checkpoint if that is nearer
+ */
+void hugeDecode(struct hugeCursor *c, int at, erow *row)
+{
+	if (c->gen != W.gen || c->line > at || at - c->line > at % EDIT_HUGE_STRIDE)
+	{
+		c->gen = W.gen;
+		c->line = at - at % EDIT_HUGE_STRIDE;
+		c->off = E.mapping->marks[at / EDIT_HUGE_STRIDE];
+	}
+	char *end = E.map + E.maplen;
+	size_t k = at - c->line;
+	char *p = (char *)editorByteSkip(E.map + c->off, end - (E.map + c->off), '\n', &k);
+	c->line = at - k;
+	c->off = p - E.map;
+
+	char *eol = memchr(p, '\n', end - p);
+	if (eol == NULL)
+		eol = end;
+	while (eol > p && (eol[-1] == '\n' || eol[-1] == '\r'))
+		eol--;
+	row->size = eol - p;
+	row->rsize = 0;
+	row->ntabs = 0;
+	row->u.heap.chars = p;
+	row->u.heap.render = NULL;
+	row->flags = ROW_MAPPED | ROW_NORENDER | ROW_DAMAGED;
+}
+
+void hugeUnlink(int s)
+{
+	struct hugeSlot *slot = &W.slots[s];
+	if (slot->prev != -1)
+		W.slots[slot->prev].next = slot->next;
+	else
+		W.head = slot->next;
+	if (slot->next != -1)
+		W.slots[slot->next].prev = slot->prev;
+	else
+		W.tail = slot->prev;
+}
+
+void hugePush(int s)
+{
+	W.slots[s].prev = -1;
+	W.slots[s].next = W.head;
+	if (W.head != -1)
+		W.slots[W.head].prev = s;
+	W.head = s;
+	if (W.tail == -1)
+		W.tail = s;
+}
+
+erow *hugeAt(int at)
+{
+	int mask = 2 * EDIT_HUGE_CACHE - 1;
+	int s;
+	for (s = W.buckets[at & mask]; s != -1; s = W.slots[s].hnext)
+		if (W.slots[s].line == at)
+			break;
+
+	if (s != -1)
+		hugeUnlink(s);
+	else
+	{
+		if (W.nslots < EDIT_HUGE_CACHE)
+			s = W.nslots++;
+		else
+		{
+			// the least recently used row makes room
+			s = W.tail;
+			int *p = &W.buckets[W.slots[s].line & mask];
+			while (*p != s)
+				p = &W.slots[*p].hnext;
+			*p = W.slots[s].hnext;
+			editorRowFreeRender(&W.slots[s].row);
+			hugeUnlink(s);
+		}
+		hugeDecode(&W.cursor, at, &W.slots[s].row);
+		W.slots[s].line = at;
+		W.slots[s].hnext = W.buckets[at & mask];
+		W.buckets[at & mask] = s;
+	}
+	hugePush(s);
+	return &W.slots[s].row;
+}
+
+/**
+ * Decodes into a row of the calling thread's own, valid until its next
+ * peek(), and keeps a cursor per thread so scans walk the file once
+ */
+erow *hugePeek(int at)
+{
+	static __thread erow row;
+	static __thread struct hugeCursor cursor;
+	hugeDecode(&cursor, at, &row);
+	return &row;
+}
+
+void hugeSplice(int at, int n)
+{
+	(void)at;
+	(void)n;
+}
+
+void hugeRemove(int at, int n)
+{
+	// editorHugeClose() drops the cache, the renders go with the heap
+	(void)at;
+	(void)n;
+}
+
+struct rowStore hugeStore = {hugeAt, hugePeek, hugeSplice, hugeRemove};
+
+/**
+ * Moves the rows of the flat array into a rope
+ * Called once a buffer outgrows the flat array's fast path
+ */
+void editorUseRope()
+{
+	int at;
+	E.rope = NULL;
+	E.rope_hit = NULL;
+	for (at = 0; at < E.numrows; at += EDIT_ROPE_LEAF)
+	{
+		int n = E.numrows - at;
+		if (n > EDIT_ROPE_LEAF)
+			n = EDIT_ROPE_LEAF;
+		E.rope = ropeMerge(E.rope, ropeNewNode(&E.row[at], n));
+	}
+	free(E.row);
+	E.row = NULL;
+	E.rowcap = 0;
+	E.store = &ropeStore;
+}
+
+erow *editorRowAt(int at)
+{
+	return E.store->at(at);
+}
+
+/**
+ * Records that rows [from, to) were edited, for editorHlSync() to look at
+ * An empty range is where rows were removed, so the row after them may
+ * now start in another state. Rows whose state isn't known yet are lexed
+ * when they are reached anyway
+ */
+void editorHlDamage(int from, int to)
+{
+	if (from >= E.hl_rows)
+		return;
+	if (to > E.hl_rows)
+		to = E.hl_rows;
+	if (from < E.hl_lo)
+		E.hl_lo = from;
+	if (to > E.hl_hi)
+		E.hl_hi = to;
+}
+
+/**
+ * Records that rows [from, to) no longer match the file
+ * Overlapping and touching ranges merge; past EDIT_SAVE_RANGES the two
+ * closest are merged, so the list only ever grows less precise
+ * Every edit passes through here, so it is also where highlighting
+ * learns what to redo
+ */
+void editorDirtyRows(int from, int to)
+{
+	editorHlDamage(from, to);
+	struct rowRange *r = E.dirty_rows;
+	int i = 0;
+	while (i < E.ndirty && r[i].hi < from)
+		i++;
+	int j = i;
+	while (j < E.ndirty && r[j].lo <= to)
+	{
+		if (r[j].lo < from)
+			from = r[j].lo;
+		if (r[j].hi > to)
+			to = r[j].hi;
+		j++;
+	}
+	memmove(&r[i + 1], &r[j], (E.ndirty - j) * sizeof(*r));
+	r[i].lo = from;
+	r[i].hi = to;
+	E.ndirty += 1 - (j - i);
+
+	if (E.ndirty > EDIT_SAVE_RANGES)
+	{
+		int k = 0;
+		for (j = 1; j < E.ndirty - 1; j++)
+			if (r[j + 1].lo - r[j].hi < r[k + 1].lo - r[k].hi)
+				k = j;
+		r[k].hi = r[k + 1].hi;
+		memmove(&r[k + 1], &r[k + 2], (E.ndirty - k - 2) * sizeof(*r));
+		E.ndirty--;
+	}
+}
+
+/**
+ * Makes room for n rows at index at
+ * Switches the buffer to the rope backend once it grows past
+ * EDIT_ROPE_MIN_ROWS; fill the new rows in with editorRowAt()
+ */
+void editorSpliceRows(int at, int n)
+{
+	editorFlattenGap();
+	if (E.store == &flatStore && E.numrows + n >= EDIT_ROPE_MIN_ROWS)
+		editorUseRope();
+	E.store->splice(at, n);
+	E.numrows += n;
+	editorDamageRows(at);
+
+	int j;
+	for (j = 0; j < E.ndirty; j++)
+	{
+		if (E.dirty_rows[j].lo >= at)
+			E.dirty_rows[j].lo += n;
+		if (E.dirty_rows[j].hi > at)
+			E.dirty_rows[j].hi += n;
+	}
+	if (E.hl_rows > at)
+		E.hl_rows += n;
+	if (E.hl_lo != INT_MAX)
+	{
+		if (E.hl_lo >= at)
+			E.hl_lo += n;
+		if (E.hl_hi > at)
+			E.hl_hi += n;
+	}
+	editorDirtyRows(at, at + n);
+	for (j = 0; j < EDIT_RENDER_CACHE; j++)
+		if (R.rows[j] >= at)
+			R.rows[j] += n;
+}
+
+void editorRemoveRows(int at, int n)
+{
+	editorFlattenGap();
+	E.store->remove(at, n);
+	E.numrows -= n;
+	editorDamageRows(at);
+
+	int j;
+	for (j = 0; j < E.ndirty; j++)
+	{
+		struct rowRange *r = &E.dirty_rows[j];
+		r->lo = r->lo <= at ? r->lo : r->lo < at + n ? at : r->lo - n;
+		r->hi = r->hi <= at ? r->hi : r->hi < at + n ? at : r->hi - n;
+	}
+	E.hl_rows = E.hl_rows <= at ? E.hl_rows : E.hl_rows < at + n ? at : E.hl_rows - n;
+	if (E.hl_lo != INT_MAX)
+	{
+		E.hl_lo = E.hl_lo <= at ? E.hl_lo : E.hl_lo < at + n ? at : E.hl_lo - n;
+		E.hl_hi = E.hl_hi <= at ? E.hl_hi : E.hl_hi < at + n ? at : E.hl_hi - n;
+	}
+	editorDirtyRows(at, at);
+	for (j = 0; j < EDIT_RENDER_CACHE; j++)
+		if (R.rows[j] >= at)
+			R.rows[j] = R.rows[j] < at + n ? -1 : R.rows[j] - n;
+}
+
+/*** row operations ***/
+
+/**
+ * Returns the chars of a row, wherever the row keeps them
+ * Inline chars move with the row, so the pointer is only good until
+ * rows are next spliced or removed
+ */
+char *editorRowText(erow *row)
+{
+	return (row->flags & ROW_INLINE) ? row->u.text : row->u.heap.chars;
+}
+
+/**
+ * Returns the tab index of a tab row, which shares a heap block with
+ * (and is the start of) the render buffer
+ */
+struct tabStop *editorRowTabs(erow *row)
+{
+	return row->u.heap.render ? (struct tabStop *)row->u.heap.render - row->ntabs : NULL;
+}
+
+/**
+ * Returns the number of tabs in a tab row before cx position cx
+ */
+int editorRowTabsBefore(erow *row, int cx)
+{
+	struct tabStop *stops = editorRowTabs(row);
+	int lo = 0, hi = row->ntabs;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (stops[mid].cx < cx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void editorRowFreeRender(erow *row)
+{
+	editorHeapFree(editorRowTabs(row));
+	row->u.heap.render = NULL;
+	row->ntabs = 0;
+}
+
+/**
+ * Converts a cx position to a render column
+ * Rows with a render look it up in O(log tabs) from the tab index, only
+ * rows not rendered yet are walked
+ */
+int editorRowCxToRx(erow *row, int cx)
+{
+	if (row->flags & ROW_TABS)
+	{
+		int i = editorRowTabsBefore(row, cx);
+		if (i == 0)
+			return cx;
+		struct tabStop *stop = &editorRowTabs(row)[i - 1];
+		return stop->rx + cx - stop->cx - 1;
+	}
+	if (!(row->flags & ROW_NORENDER))
+		return cx;
+
+	int skip = (row->flags & ROW_GAP) ? E.gaplen : 0;
+	int gap = skip ? E.gap : row->size;
+	char *chars = editorRowText(row);
+	int rx = editorSpanRx(chars, cx < gap ? cx : gap, 0);
+	if (cx > gap)
+		rx = editorSpanRx(chars + gap + skip, cx - gap, rx);
+	return rx;
+}
+
+/**
+ * Converts a render column to the cx position of the char drawn there,
+ * or the row size past the end
+ */
+int editorRowRxToCx(erow *row, int rx)
+{
+	if (rx < 0)
+		rx = 0;
+	if (row->flags & ROW_TABS)
+	{
+		struct tabStop *stops = editorRowTabs(row);
+		int lo = 0, hi = row->ntabs;
+		while (lo < hi)
+		{
+			int mid = lo + (hi - lo) / 2;
+			if (stops[mid].rx <= rx)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		// plain chars after the last tab ending at or before rx, up to
+		// the next tab, which covers rx if the chars run out
+		int cx = lo ? stops[lo - 1].cx + 1 + rx - stops[lo - 1].rx : rx;
+		if (lo < row->ntabs && cx > stops[lo].cx)
+			cx = stops[lo].cx;
+		return cx < row->size ? cx : row->size;
+	}
+	if (!(row->flags & ROW_NORENDER))
+		return rx < row->size ? rx : row->size;
+
+	int skip = (row->flags & ROW_GAP) ? E.gaplen : 0;
+	int gap = skip ? E.gap : row->size;
+	char *chars = editorRowText(row);
+	int cur = 0;
+	int cx = editorSpanCx(chars, gap, &cur, rx);
+	if (cx < gap)
+		return cx;
+	return gap + editorSpanCx(chars + gap + skip, row->size - gap, &cur, rx);
+}
+
+/**
+ * Rebuilds the render string of a row from its chars
+ * Works on the gap row too, by reading around the gap
+ * Only rows containing tabs get a separate render buffer, indexed by
+ * their tab stops
+ */
+void editorUpdateRow(erow *row)
+{
+	int skip = (row->flags & ROW_GAP) ? E.gaplen : 0;
+	int gap = skip ? E.gap : row->size;
+	char *chars = editorRowText(row);
+	int before = editorByteCount(chars, gap, '\t');
+	int tabs = before + editorByteCount(chars + gap + skip, row->size - gap, '\t');
+
+	row->flags &= ~(ROW_TABS | ROW_NORENDER);
+	row->flags |= ROW_DAMAGED;
+	if (tabs == 0)
+	{
+		// a row without tabs renders as its chars, no copy needed
+		if (!(row->flags & ROW_INLINE))
+			editorRowFreeRender(row);
+		row->rsize = row->size;
+		return;
+	}
+	row->flags |= ROW_TABS;
+
+	size_t cap = tabs * sizeof(struct tabStop) + row->size + tabs * (EDIT_TAB_STOP - 1) + 1;
+	struct tabStop *stops = editorHeapRealloc(editorRowTabs(row), cap);
+	row->ntabs = tabs;
+	row->u.heap.render = (char *)(stops + tabs);
+	int rx = editorExpandTabs(row->u.heap.render, 0, chars, gap, 0, stops);
+	rx = editorExpandTabs(row->u.heap.render, rx, chars + gap + skip, row->size - gap, gap, stops + before);
+	row->u.heap.render[rx] = '\0';
+	row->rsize = rx;
+}
+
+/**
+ * Builds the render string of a row the first time it is needed
+ * Rows start without one, whether they are read from a file or
+ * inserted, so only rows that are actually drawn pay for tab expansion
+ */
+void editorRowRender(erow *row)
+{
+	if (row->flags & ROW_NORENDER)
+		editorUpdateRow(row);
+}
+
+/**
+ * Drops the tab expansion of a row until it is drawn again
+ * editorRowCxToRx() and editorRowRxToCx() walk the chars meanwhile
+ */
+void editorRowEvictRender(erow *row)
+{
+	if (row->flags & ROW_TABS)
+	{
+		editorRowFreeRender(row);
+		row->flags = (row->flags & ~ROW_TABS) | ROW_NORENDER;
+	}
+	row->flags &= ~ROW_CACHED;
+}
+
+/**
+ * Lists a drawn tab row in the render cache, evicting another if needed
+ * Rows within a screen of the viewport are passed over, they would only
+ * be rendered again on the next scroll
+ */
+void editorRenderCacheAdd(int at)
+{
+	int lo = E.rowoff - E.screenrows;
+	int hi = E.rowoff + 2 * E.screenrows;
+	int tries;
+	for (tries = 0; tries < EDIT_RENDER_CACHE; tries++)
+	{
+		int *slot = &R.rows[R.next++ & (EDIT_RENDER_CACHE - 1)];
+		if (*slot >= 0 && *slot < E.numrows)
+		{
+			erow *row = editorRowAt(*slot);
+			if ((row->flags & ROW_CACHED) && *slot >= lo && *slot < hi)
+				continue;
+			editorRowEvictRender(row);
+		}
+		*slot = at;
+		editorRowAt(at)->flags |= ROW_CACHED;
+		return;
+	}
+}
+
+/**
+ * Builds the render of row at for drawing it
+ * Huge files are left out, their decoded rows are a bounded cache
+ * already (see hugeAt())
+ */
+void editorRowDraw(erow *row, int at)
+{
+	editorRowRender(row);
+	if ((row->flags & (ROW_TABS | ROW_CACHED)) == ROW_TABS && !W.active)
+		editorRenderCacheAdd(at);
+}
+
+/**
+ * Hands chars a running save still reads over to it, to free when done
+ */
+void editorSaveOrphan(char *chars)
+{
+	if (S.norphans == S.orphancap)
+	{
+		S.orphancap = S.orphancap ? S.orphancap * 2 : 64;
+		S.orphans = realloc(S.orphans, S.orphancap * sizeof(char *));
+	}
+	S.orphans[S.norphans++] = chars;
+}
+
+/**
+ * Gives a row its own heap copy of chars before it is modified
+ * The mapping is read-only and shared chars are being saved, so every
+ * row edit function calls this first
+ */
+void editorRowOwn(erow *row)
+{
+	if (!(row->flags & (ROW_MAPPED | ROW_SHARED | ROW_INLINE)))
+		return;
+	char *chars = editorHeapAlloc(row->size + 1);
+	memcpy(chars, editorRowText(row), row->size);
+	chars[row->size] = '\0';
+	if (row->flags & ROW_SHARED)
+		editorSaveOrphan(row->u.heap.chars);
+	if (row->flags & ROW_INLINE)
+		row->u.heap.render = NULL;
+	row->u.heap.chars = chars;
+	row->flags &= ~(ROW_MAPPED | ROW_SHARED | ROW_INLINE);
+}
+
+/**
+ * Moves the chars of a short, tab-free heap row into the row itself
+ * Done whenever a row stops being edited, so only the row under the
+ * cursor keeps a heap buffer for its length
+ */
+void editorRowPack(erow *row)
+{
+	if (row->size >= EDIT_ROW_INLINE ||
+			(row->flags & (ROW_MAPPED | ROW_SHARED | ROW_GAP | ROW_TABS | ROW_NORENDER | ROW_INLINE)))
+		return;
+	char *chars = row->u.heap.chars;
+	memcpy(row->u.text, chars, row->size);
+	row->u.text[row->size] = '\0';
+	editorHeapFree(chars);
+	row->flags |= ROW_INLINE;
+}
+
+/**
+ * Closes the gap of the gap row so its chars are contiguous again
+ * Must be called before anything but the gap-aware functions reads chars
+ */
+void editorRowFlatten(erow *row)
+{
+	if (!(row->flags & ROW_GAP))
+		return;
+	memmove(&row->u.heap.chars[E.gap], &row->u.heap.chars[E.gap + E.gaplen], row->size - E.gap);
+	row->u.heap.chars[row->size] = '\0';
+	row->flags &= ~ROW_GAP;
+	E.gaprow = -1;
+	editorRowPack(row);
+}
+
+void editorFlattenGap()
+{
+	if (E.gaprow != -1)
+		editorRowFlatten(editorRowAt(E.gaprow));
+}
+
+/**
+ * Turns a row into the gap row with its gap at cx position at
+ * Only one row at a time holds a gap, so the previous one is flattened
+ * Moving the gap costs the distance moved, so typing or deleting in one
+ * spot is O(1) amortized
+ */
+void editorRowMoveGap(erow *row, int at)
+{
+	if (!(row->flags & ROW_GAP))
+	{
+		editorFlattenGap();
+		editorRowOwn(row);
+		// the row being edited is always the one under the cursor
+		E.gaprow = E.cy;
+		E.gap = row->size;
+		E.gaplen = 0;
+		row->flags |= ROW_GAP;
+	}
+
+	if (at < E.gap)
+		memmove(&row->u.heap.chars[at + E.gaplen], &row->u.heap.chars[at], E.gap - at);
+	else if (at > E.gap)
+		memmove(&row->u.heap.chars[E.gap], &row->u.heap.chars[E.gap + E.gaplen], at - E.gap);
+	E.gap = at;
+}
+
+int editorRowChar(erow *row, int at)
+{
+	if ((row->flags & ROW_GAP) && at >= E.gap)
+		at += E.gaplen;
+	return editorRowText(row)[at];
+}
+
+/**
+ * Patches the render of a tab row after one char c was inserted at at
+ * (grow 1) or deleted from there (grow -1), the tab stops still being
+ * those from before the edit
+ * Only the tab-free run from at to the next tab and that tab's width
+ * can change, so the run and the render after the tab are moved over
+ * rather than expanded again, and the stops after it shifted to match
+ */
+void editorRowPatchRender(erow *row, int at, int c, int grow)
+{
+	struct tabStop *stops = editorRowTabs(row);
+	int i = editorRowTabsBefore(row, at);
+	int rx = i ? stops[i - 1].rx + at - stops[i - 1].cx - 1 : at;
+	// k is the first tab after the edit that is still there
+	int k = grow < 0 && c == '\t' ? i + 1 : i;
+	int old_size = row->size - grow;
+	int old_end = k < row->ntabs ? stops[k].rx : row->rsize;
+	int run = (k < row->ntabs ? stops[k].cx : old_size) - (grow > 0 ? at : at + 1);
+	int run_from = grow > 0 ? rx : c == '\t' ? stops[i].rx : rx + 1;
+
+	int run_to = rx;
+	if (grow > 0)
+		run_to += c == '\t' ? EDIT_TAB_STOP - rx % EDIT_TAB_STOP : 1;
+	int end = run_to + run;
+	if (k < row->ntabs)
+		end += EDIT_TAB_STOP - end % EDIT_TAB_STOP;
+	int delta = end - old_end;
+	int ntabs = row->ntabs + (c == '\t' ? grow : 0);
+
+	char *from = row->u.heap.render;
+	struct tabStop *to = stops;
+	if (ntabs != row->ntabs)
+	{
+		// a tab was typed or deleted, so render moves within its block too
+		to = editorHeapAlloc(ntabs * sizeof(struct tabStop) + row->rsize + delta + 1);
+		memcpy(to, stops, i * sizeof(struct tabStop));
+		memcpy(to + ntabs - (row->ntabs - k), stops + k, (row->ntabs - k) * sizeof(struct tabStop));
+		memcpy(to + ntabs, from, rx);
+	}
+	else if (delta > 0)
+	{
+		to = stops = editorHeapRealloc(stops, ntabs * sizeof(struct tabStop) + row->rsize + delta + 1);
+		from = (char *)(stops + ntabs);
+	}
+	char *render = (char *)(to + ntabs);
+
+	// whichever of the run and the rest moves right goes first, and the
+	// rest stays put when the tab took up the change
+	int rest = render != from || delta ? row->rsize - old_end + 1 : 0;
+	if (run_to > run_from)
+		memmove(&render[end], &from[old_end], rest);
+	memmove(&render[run_to], &from[run_from], run);
+	if (run_to <= run_from)
+		memmove(&render[end], &from[old_end], rest);
+	if (grow > 0)
+		memset(&render[rx], c == '\t' ? ' ' : c, run_to - rx);
+	memset(&render[run_to + run], ' ', end - run_to - run);
+
+	if (to != stops)
+		editorHeapFree(stops);
+	int first = i;
+	if (grow > 0 && c == '\t')
+	{
+		to[i].cx = at;
+		to[i].rx = run_to;
+		first++;
+	}
+	for (k = first; k < ntabs; k++)
+	{
+		to[k].cx += grow;
+		to[k].rx += delta;
+	}
+	row->u.heap.render = render;
+	row->ntabs = ntabs;
+	row->rsize += delta;
+}
+
+/**
+ * Widens a full gap in proportion to the row length
+ */
+void editorRowGrowGap(erow *row)
+{
+	int grow = row->size / 2 + EDIT_GAP_MIN;
+	row->u.heap.chars = editorHeapRealloc(row->u.heap.chars, row->size + E.gaplen + grow + 1);
+	memmove(&row->u.heap.chars[E.gap + E.gaplen + grow], &row->u.heap.chars[E.gap + E.gaplen],
+					row->size - E.gap);
+	E.gaplen += grow;
+}
+
+/**
+ * Adds a batch of rows of text to the editor's buffer
+ * @param at: Index of the first new row
+ * @param lines: The strings to add
+ * @param lens: Length of each string
+ * @param n: Number of rows
+ * Copies each string into its own row and updates the row count
+ * Renders are left for editorRowDraw() to build, so a paste or a file
+ * costs no tab expansion for rows that are never shown
+ */
+void editorInsertRows(int at, char **lines, size_t *lens, int n)
+{
+	if (at < 0 || at > E.numrows || n <= 0)
+		return;
+	editorSpliceRows(at, n);
+
+	int i;
+	for (i = 0; i < n; i++)
+	{
+		erow *row = editorRowAt(at + i);
+		row->size = lens[i];
+		row->ntabs = 0;
+		if (lens[i] < EDIT_ROW_INLINE && !memchr(lines[i], '\t', lens[i]))
+		{
+			// short and tab-free, so it renders as it is
+			row->flags = ROW_INLINE | ROW_DAMAGED;
+			row->rsize = lens[i];
+			memcpy(row->u.text, lines[i], lens[i]);
+			row->u.text[lens[i]] = '\0';
+		}
+		else
+		{
+			row->flags = ROW_NORENDER | ROW_DAMAGED;
+			row->rsize = 0;
+			row->u.heap.chars = editorHeapAlloc(lens[i] + 1);
+			memcpy(row->u.heap.chars, lines[i], lens[i]);
+			row->u.heap.chars[lens[i]] = '\0';
+			row->u.heap.render = NULL;
+		}
+	}
+
+	E.dirty++;
+}
+
+/**
+ * Adds a new row of text to the editor's buffer
+ * @param s: The string to add
+ * @param len: Length of the string
+ * Single-row form of editorInsertRows()
+ */
+void editorInsertRow(int at, char *s, size_t len)
+{
+	editorInsertRows(at, &s, &len, 1);
+}
+
+void editorRowInsertChar(erow *row, int at, int c)
 {
 	if (at < 0 || at > row->size)
 		at = row->size;
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+	int tabs = row->flags & ROW_TABS;
+	editorRowMoveGap(row, at);
+	editorDirtyRows(E.gaprow, E.gaprow + 1);
+	if (E.gaplen == 0)
+		editorRowGrowGap(row);
+	row->u.heap.chars[E.gap++] = c;
+	E.gaplen--;
 	row->size++;
-	row->chars[at] = c;
+	row->flags |= ROW_DAMAGED;
+
+	if (tabs)
+		editorRowPatchRender(row, at, c, 1);
+	else if (c == '\t' && !(row->flags & ROW_NORENDER))
+		editorUpdateRow(row);
+	else
+		row->rsize = row->size;
+	E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at)
+{
+	if (at < 0 || at >= row->size)
+		return;
+	int tabs = row->flags & ROW_TABS;
+	int c = editorRowChar(row, at);
+
+	editorRowMoveGap(row, at + 1);
+	editorDirtyRows(E.gaprow, E.gaprow + 1);
+	E.gap--;
+	E.gaplen++;
+	row->size--;
+	row->flags |= ROW_DAMAGED;
+
+	if (tabs && c == '\t' && row->ntabs == 1)
+		editorUpdateRow(row);
+	else if (tabs)
+		editorRowPatchRender(row, at, c, -1);
+	else
+		row->rsize = row->size;
+	E.dirty++;
+}
+
+void editorFreeRow(erow *row)
+{
+	if (row->flags & ROW_INLINE)
+		return;
+	editorRowFreeRender(row);
+	if (row->flags & ROW_SHARED)
+		editorSaveOrphan(row->u.heap.chars);
+	else if (!(row->flags & ROW_MAPPED))
+		editorHeapFree(row->u.heap.chars);
+	if (row->flags & ROW_GAP)
+		E.gaprow = -1;
+}
+
+void editorDelRow(int at)
+{
+	if (at < 0 || at >= E.numrows)
+		return;
+	editorFreeRow(editorRowAt(at));
+	editorRemoveRows(at, 1);
+	E.dirty++;
+}
+
+/*** syntax highlighting ***/
+
+int editorIsSeparator(int c)
+{
+	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+/**
+ * Makes E.hl and E.hl_text hold at least n bytes
+ */
+void editorHlReserve(int n)
+{
+	if (n <= E.hl_cap)
+		return;
+	E.hl_cap = n * 2 > 256 ? n * 2 : 256;
+	E.hl = realloc(E.hl, E.hl_cap);
+	E.hl_text = realloc(E.hl_text, E.hl_cap);
+}
+
+/**
+ * Returns the chars of a row in one piece, size bytes long
+ * The gap row is copied into E.hl_text rather than flattened, which
+ * would cost the next keystroke a gap move
+ */
+const char *editorHlText(erow *row)
+{
+	if (!(row->flags & ROW_GAP))
+		return editorRowText(row);
+	editorHlReserve(row->size);
+	memcpy(E.hl_text, row->u.heap.chars, E.gap);
+	memcpy(E.hl_text + E.gap, row->u.heap.chars + E.gap + E.gaplen, row->size - E.gap);
+	return E.hl_text;
+}
+
+/**
+ * Highlights n chars of s by E.syntax
+ * @param open: Whether s starts inside a multi-line comment
+ * @param hl: Set to the class of each char, or NULL to only follow the
+ *            comments and strings, all that decides the state
+ * Returns whether s ends inside a multi-line comment
+ * Tabs and spaces are alike to it, so a render highlights as its chars
+ */
+int editorHlLex(const char *s, int n, int open, unsigned char *hl)
+{
+	struct editorSyntax *syn = E.syntax;
+	char **keywords = syn->keywords;
+	char *scs = syn->singleline_comment_start;
+	char *mcs = syn->multiline_comment_start;
+	char *mce = syn->multiline_comment_end;
+	int scs_len = scs ? strlen(scs) : 0;
+	int mcs_len = mcs ? strlen(mcs) : 0;
+	int mce_len = mce ? strlen(mce) : 0;
+
+	int prev_sep = 1;
+	int in_string = 0;
+	int in_comment = open && mcs_len && mce_len;
+	int i = 0;
+	while (i < n)
+	{
+		char c = s[i];
+		unsigned char prev_hl = (hl && i > 0) ? hl[i - 1] : HL_NORMAL;
+
+		if (in_comment)
+		{
+			// nothing but the end of the comment matters until it is found
+			char *end = editorMemFind(&s[i], n - i, mce, mce_len);
+			int to = end ? end - s + mce_len : n;
+			if (hl)
+				memset(&hl[i], HL_MLCOMMENT, to - i);
+			i = to;
+			in_comment = end == NULL;
+			prev_sep = 1;
+			continue;
+		}
+
+		if (in_string)
+		{
+			if (hl)
+				hl[i] = HL_STRING;
+			if (c == '\\' && i + 1 < n)
+			{
+				if (hl)
+					hl[i + 1] = HL_STRING;
+				i += 2;
+				continue;
+			}
+			if (c == in_string)
+				in_string = 0;
+			i++;
+			prev_sep = 1;
+			continue;
+		}
+
+		if (scs_len && n - i >= scs_len && !memcmp(&s[i], scs, scs_len))
+		{
+			if (hl)
+				memset(&hl[i], HL_COMMENT, n - i);
+			break;
+		}
+
+		if (mcs_len && mce_len && n - i >= mcs_len && !memcmp(&s[i], mcs, mcs_len))
+		{
+			if (hl)
+				memset(&hl[i], HL_MLCOMMENT, mcs_len);
+			i += mcs_len;
+			in_comment = 1;
+			continue;
+		}
+
+		if ((syn->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\''))
+		{
+			if (hl)
+				hl[i] = HL_STRING;
+			in_string = c;
+			i++;
+			continue;
+		}
+
+		// numbers and keywords never carry over to the next row
+		if (!hl)
+		{
+			i++;
+			continue;
+		}
+
+		hl[i] = HL_NORMAL;
+		if ((syn->flags & HL_HIGHLIGHT_NUMBERS) &&
+				((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+				 (c == '.' && prev_hl == HL_NUMBER)))
+		{
+			hl[i] = HL_NUMBER;
+			i++;
+			prev_sep = 0;
+			continue;
+		}
+
+		if (prev_sep)
+		{
+			int j;
+			for (j = 0; keywords[j]; j++)
+			{
+				int klen = strlen(keywords[j]);
+				int kw2 = keywords[j][klen - 1] == '|';
+				if (kw2)
+					klen--;
+				if (n - i >= klen && !memcmp(&s[i], keywords[j], klen) &&
+						(i + klen == n || editorIsSeparator((unsigned char)s[i + klen])))
+				{
+					memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+					i += klen;
+					break;
+				}
+			}
+			if (keywords[j] != NULL)
+			{
+				prev_sep = 0;
+				continue;
+			}
+		}
+
+		prev_sep = editorIsSeparator((unsigned char)c);
+		i++;
+	}
+	return in_comment;
+}
+
+/**
+ * Lexes row at from state open and caches the state it ends in
+ */
+int editorHlRow(int at, int open)
+{
+	erow *row = editorRowAt(at);
+	open = editorHlLex(editorHlText(row), row->size, open, NULL);
+	if (open)
+		row->flags |= ROW_COMMENT;
+	else
+		row->flags &= ~ROW_COMMENT;
+	return open;
+}
+
+/**
+ * Brings the end states of rows [0, upto) up to date
+ * Lexing starts again at the first row edited since the last call and
+ * stops at the first row after the edits that ends in the same state it
+ * did before, since every row below it then starts as it did. A change
+ * that runs on past the bottom of the screen, like an unclosed comment,
+ * leaves the rest to be lexed when it is scrolled to, so a keystroke
+ * costs at most the rows down to there
+ */
+void editorHlSync(int upto)
+{
+	if (E.syntax == NULL || W.active)
+		return;
+	if (E.hl_lo != INT_MAX)
+	{
+		int bottom = E.rowoff + E.screenrows;
+		int j = E.hl_lo;
+		int open = j > 0 && (editorRowAt(j - 1)->flags & ROW_COMMENT);
+		for (; j < E.hl_rows; j++)
+		{
+			int was = (editorRowAt(j)->flags & ROW_COMMENT) != 0;
+			open = editorHlRow(j, open);
+			if (j >= E.hl_hi && open == was)
+				break;
+			if (open != was)
+				editorDamageRows(j + 1);
+			if (j >= bottom)
+			{
+				E.hl_rows = j + 1;
+				break;
+			}
+		}
+		E.hl_lo = INT_MAX;
+		E.hl_hi = 0;
+	}
+
+	if (upto > E.numrows)
+		upto = E.numrows;
+	int open = E.hl_rows > 0 && (editorRowAt(E.hl_rows - 1)->flags & ROW_COMMENT);
+	while (E.hl_rows < upto)
+	{
+		open = editorHlRow(E.hl_rows, open);
+		E.hl_rows++;
+	}
+}
+
+int editorSyntaxToColor(int hl)
+{
+	switch (hl)
+	{
+	case HL_COMMENT:
+	case HL_MLCOMMENT:
+		return 36;
+	case HL_KEYWORD1:
+		return 33;
+	case HL_KEYWORD2:
+		return 32;
+	case HL_STRING:
+		return 35;
+	case HL_NUMBER:
+		return 31;
+	default:
+		return 39;
+	}
+}
+
+/**
+ * Picks the syntax for E.filename by its extension or name
+ * Every row's state is forgotten, to be lexed again as it is drawn
+ */
+void editorSelectSyntaxHighlight()
+{
+	E.syntax = NULL;
+	E.hl_rows = 0;
+	E.hl_lo = INT_MAX;
+	E.hl_hi = 0;
+	editorDamageRows(0);
+	if (E.filename == NULL)
+		return;
+
+	char *ext = strrchr(E.filename, '.');
+	unsigned int j;
+	for (j = 0; j < HLDB_ENTRIES; j++)
+	{
+		struct editorSyntax *s = &HLDB[j];
+		int i;
+		for (i = 0; s->filematch[i]; i++)
+		{
+			int is_ext = s->filematch[i][0] == '.';
+			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+					(!is_ext && strstr(E.filename, s->filematch[i])))
+			{
+				E.syntax = s;
+				return;
+			}
+		}
+	}
+}
+
+/*** editor operations ***/
+
+/**
+ * Refuses to change a buffer in huge mode, which is only ever viewed
+ */
+int editorReadOnly()
+{
+	if (!W.active)
+		return 0;
+	editorSetStatusMessage("Huge files are read-only");
+	return 1;
+}
+
+void editorInsertChar(int c)
+{
+	if (editorReadOnly())
+		return;
+	int chain = 0;
+	if (E.cy == E.numrows)
+	{
+		editorUndoRecord(UNDO_ROW, E.numrows, 0, 0);
+		editorInsertRow(E.numrows, "", 0);
+		chain = UNDO_CHAIN;
+	}
+	editorUndoRecord(UNDO_INSERT | chain, E.cy, E.cx, c);
+	editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+	E.cx++;
+}
+
+/**
+ * Breaks the row at the cursor and moves the cursor to the new row
+ * @param chain: UNDO_CHAIN if this is part of the change logged before
+ */
+void editorBreakRow(int chain)
+{
+	if (E.cx == 0)
+	{
+		editorUndoRecord(UNDO_ROW | chain, E.cy, 0, 0);
+		editorInsertRow(E.cy, "", 0);
+	}
+	else
+	{
+		editorUndoRecord(UNDO_SPLIT | chain, E.cy, E.cx, 0);
+		erow *row = editorRowAt(E.cy);
+		editorRowFlatten(row);
+		// inline chars would move under us when the new row is spliced in
+		editorRowOwn(row);
+		editorInsertRow(E.cy + 1, &row->u.heap.chars[E.cx], row->size - E.cx);
+		row = editorRowAt(E.cy);
+		row->size = E.cx;
+		row->u.heap.chars[row->size] = '\0';
+		editorUpdateRow(row);
+		editorRowPack(row);
+		editorDirtyRows(E.cy, E.cy + 1);
+	}
+	E.cy++;
+	E.cx = 0;
+}
+
+void editorInsertNewline()
+{
+	if (editorReadOnly())
+		return;
+	editorBreakRow(0);
+}
+
+/**
+ * Inserts len chars of s into a row at cx position at in one go
+ * The caller marks the row dirty
+ */
+void editorRowInsertString(erow *row, int at, char *s, size_t len)
+{
+	editorRowFlatten(row);
+	editorRowOwn(row);
+	row->u.heap.chars = editorHeapRealloc(row->u.heap.chars, row->size + len + 1);
+	memmove(&row->u.heap.chars[at + len], &row->u.heap.chars[at], row->size - at + 1);
+	memcpy(&row->u.heap.chars[at], s, len);
+	row->size += len;
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+/**
+ * Deletes len chars of a row from cx position at in one go
+ * The caller marks the row dirty
+ */
+void editorRowDeleteString(erow *row, int at, size_t len)
+{
+	editorRowFlatten(row);
+	editorRowOwn(row);
+	memmove(&row->u.heap.chars[at], &row->u.heap.chars[at + len], row->size - at - len + 1);
+	row->size -= len;
 	editorUpdateRow(row);
+	editorRowPack(row);
 	E.dirty++;
 }
 
-void editorRowDelChar(erow *row, int at)
+void editorRowAppendString(erow *row, char *s, size_t len)
+{
+	editorRowInsertString(row, row->size, s, len);
+}
+
+/**
+ * Inserts text at the cursor as one undo step, leaving the cursor after it
+ * Line breaks (\r, \n or \r\n) split it into rows, and the rows between
+ * the first and the last go in with a single editorInsertRows()
+ */
+void editorInsertText(char *s, size_t len)
+{
+	if (len == 0 || editorReadOnly())
+		return;
+	size_t cap = 16;
+	int n = 0;
+	char **lines = malloc(cap * sizeof(*lines));
+	size_t *lens = malloc(cap * sizeof(*lens));
+	char *p = s;
+	char *end = s + len;
+	while (1)
+	{
+		char *eol = p;
+		while (eol < end && *eol != '\r' && *eol != '\n')
+			eol++;
+		if ((size_t)n == cap)
+		{
+			cap *= 2;
+			lines = realloc(lines, cap * sizeof(*lines));
+			lens = realloc(lens, cap * sizeof(*lens));
+		}
+		lines[n] = p;
+		lens[n++] = eol - p;
+		if (eol == end)
+			break;
+		p = eol + (eol + 1 < end && eol[0] == '\r' && eol[1] == '\n' ? 2 : 1);
+	}
+
+	// a paste too big for the undo log wipes it instead of half fitting
+	int unlogged = len + n * editorUndoSize(0) > editorUndoLimit() / 2;
+	if (unlogged)
+	{
+		U.len = U.top = 0;
+		U.last = -1;
+		U.applying = 1;
+	}
+
+	int chain = 0;
+	if (E.cy == E.numrows)
+	{
+		editorUndoRecord(UNDO_ROW, E.numrows, 0, 0);
+		editorInsertRow(E.numrows, "", 0);
+		chain = UNDO_CHAIN;
+	}
+	if (lens[0])
+	{
+		editorUndoRecordText(UNDO_INSERT | chain, E.cy, E.cx, lines[0], lens[0]);
+		editorRowInsertString(editorRowAt(E.cy), E.cx, lines[0], lens[0]);
+		editorDirtyRows(E.cy, E.cy + 1);
+		E.cx += lens[0];
+		chain = UNDO_CHAIN;
+	}
+	if (n > 1)
+	{
+		editorBreakRow(chain);
+		int j;
+		for (j = 1; j < n - 1; j++)
+			editorUndoRecordText(UNDO_ROW | UNDO_CHAIN, E.cy + j - 1, 0, lines[j], lens[j]);
+		editorInsertRows(E.cy, &lines[1], &lens[1], n - 2);
+		E.cy += n - 2;
+		if (lens[n - 1])
+		{
+			editorUndoRecordText(UNDO_INSERT | UNDO_CHAIN, E.cy, 0, lines[n - 1], lens[n - 1]);
+			editorRowInsertString(editorRowAt(E.cy), 0, lines[n - 1], lens[n - 1]);
+			editorDirtyRows(E.cy, E.cy + 1);
+			E.cx = lens[n - 1];
+		}
+	}
+
+	if (unlogged)
+	{
+		U.applying = 0;
+		editorSetStatusMessage("Pasted %zu bytes, too big to undo", len);
+	}
+	free(lines);
+	free(lens);
+}
+
+void editorDelChar()
+{
+	if (E.cy == E.numrows || editorReadOnly())
+		return;
+	if (E.cx == 0 && E.cy == 0)
+		return;
+	erow *row = editorRowAt(E.cy);
+	if (E.cx > 0)
+	{
+		editorUndoRecord(UNDO_ERASE, E.cy, E.cx - 1, editorRowChar(row, E.cx - 1));
+		editorRowDelChar(row, E.cx - 1);
+		E.cx--;
+	}
+	else
+	{
+		erow *prev = editorRowAt(E.cy - 1);
+		editorUndoRecord(UNDO_JOIN, E.cy - 1, prev->size, 0);
+		editorRowFlatten(row);
+		E.cx = prev->size;
+		editorRowAppendString(prev, editorRowText(row), row->size);
+		editorDirtyRows(E.cy - 1, E.cy);
+		editorDelRow(E.cy);
+		E.cy--;
+	}
+}
+
+/*** undo ***/
+
+/**
+ * Bytes a record with len bytes of text takes in the arena, kept a
+ * multiple of sizeof(int) so every record stays aligned
+ */
+size_t editorUndoSize(int len)
+{
+	return (sizeof(struct undoRec) + len + sizeof(int) - 1) / sizeof(int) * sizeof(int) +
+				 sizeof(int);
+}
+
+struct undoRec *editorUndoAt(size_t off)
+{
+	return (struct undoRec *)&U.buf[off];
+}
+
+/**
+ * Returns the record that ends at offset end
+ */
+struct undoRec *editorUndoBefore(size_t end)
+{
+	int size;
+	memcpy(&size, &U.buf[end - sizeof(int)], sizeof(int));
+	return editorUndoAt(end - size);
+}
+
+/**
+ * Returns the most bytes the undo log of a buffer may take
+ * That is EDIT_UNDO_BYTES unless the EDIT_UNDO_BYTES environment
+ * variable asks for another size of at least 4 KB, read the first time
+ */
+size_t editorUndoLimit()
+{
+	static size_t limit;
+	if (limit == 0)
+	{
+		char *env = getenv("EDIT_UNDO_BYTES");
+		long long n = env ? atoll(env) : 0;
+		limit = n >= 4096 ? (size_t)n : EDIT_UNDO_BYTES;
+	}
+	return limit;
+}
+
+/**
+ * Makes room for n more bytes at the end of the log
+ * Grows the arena up to editorUndoLimit(), then forgets the oldest
+ * steps, a quarter of the arena at a time so the move is rare
+ */
+void editorUndoReserve(size_t n)
+{
+	size_t limit = editorUndoLimit();
+	if (U.len + n > limit)
+	{
+		size_t want = U.len + n - limit + limit / 4;
+		size_t drop = 0;
+		while (drop < U.len && (drop < want || (editorUndoAt(drop)->op & UNDO_CHAIN)))
+			drop += editorUndoSize(editorUndoAt(drop)->len);
+		memmove(U.buf, &U.buf[drop], U.len - drop);
+		U.len -= drop;
+		U.top = U.top > drop ? U.top - drop : 0;
+		U.last = U.last >= (long)drop ? U.last - (long)drop : -1;
+	}
+	if (U.len + n > U.cap)
+	{
+		size_t cap = U.cap ? U.cap : 4096;
+		while (cap < U.len + n)
+			cap *= 2;
+		U.cap = cap < limit ? cap : limit;
+		U.buf = realloc(U.buf, U.cap);
+	}
+}
+
+/**
+ * Writes the trailing size of the record at off
+ */
+void editorUndoSeal(size_t off)
+{
+	int size = editorUndoSize(editorUndoAt(off)->len);
+	memcpy(&U.buf[off + size - sizeof(int)], &size, sizeof(int));
+	U.len = U.top = off + size;
+}
+
+/**
+ * Tries to add char c at at to the record typing has been extending
+ * Returns 0 if the change doesn't continue it, so it needs its own
+ */
+int editorUndoExtend(int op, int row, int at, int c)
+{
+	if (U.last == -1 || (size_t)U.last + editorUndoSize(editorUndoAt(U.last)->len) != U.top)
+		return 0;
+	struct undoRec *rec = editorUndoAt(U.last);
+	int last = rec->op;
+	if (rec->row != row || (op & UNDO_CHAIN))
+		return 0;
+	if (op == UNDO_INSERT && last == UNDO_INSERT && at == rec->at + rec->len)
+		;
+	else if (op == UNDO_ERASE && (last == UNDO_DELETE || (last == UNDO_ERASE && rec->len == 1)) &&
+					 at == rec->at)
+		op = UNDO_DELETE;
+	else if (op == UNDO_ERASE && last == UNDO_ERASE && at == rec->at - 1)
+		;
+	else
+		return 0;
+
+	size_t grow = editorUndoSize(rec->len + 1) - editorUndoSize(rec->len);
+	if (grow)
+	{
+		editorUndoReserve(grow);
+		if (U.last == -1)
+			return 0;
+		rec = editorUndoAt(U.last);
+	}
+	rec->op = op;
+	if (op == UNDO_ERASE)
+		rec->at = at;
+	((char *)(rec + 1))[rec->len++] = c;
+	editorUndoSeal(U.last);
+	return 1;
+}
+
+/**
+ * Logs a change the editor is about to make
+ * @param op: An undoOp, or'ed with UNDO_CHAIN if it belongs to the same
+ * keypress as the change logged before it
+ * @param c: The char typed or deleted, for the ops that have text
+ * Anything that could still be redone is dropped
+ */
+void editorUndoRecord(int op, int row, int at, int c)
+{
+	if (U.applying)
+		return;
+	U.len = U.top;
+	int base = op & ~UNDO_CHAIN;
+	if ((base == UNDO_INSERT || base == UNDO_ERASE) && editorUndoExtend(op, row, at, c))
+		return;
+
+	char ch = c;
+	editorUndoRecordText(op, row, at, &ch, base == UNDO_INSERT || base == UNDO_ERASE ? 1 : 0);
+}
+
+/**
+ * Logs a change with len bytes of text in one record
+ * UNDO_INSERT takes the text inserted, UNDO_ROW the text of the new row
+ */
+void editorUndoRecordText(int op, int row, int at, char *s, int len)
+{
+	if (U.applying)
+		return;
+	U.len = U.top;
+	editorUndoReserve(editorUndoSize(len));
+	size_t off = U.len;
+	struct undoRec *rec = editorUndoAt(off);
+	rec->op = op;
+	rec->row = row;
+	rec->at = at;
+	rec->len = len;
+	memcpy(rec + 1, s, len);
+	editorUndoSeal(off);
+	U.last = off;
+}
+
+/**
+ * Makes the change of a record again, or takes it back if undo is set
+ * Leaves the cursor where it was after the change, or before it
+ */
+void editorUndoApply(struct undoRec *rec, int undo)
+{
+	char *text = (char *)(rec + 1);
+	int op = rec->op & ~UNDO_CHAIN;
+	int k;
+	E.cy = rec->row;
+	E.cx = rec->at;
+	if (op == UNDO_INSERT || op == UNDO_DELETE || op == UNDO_ERASE)
+	{
+		erow *row = editorRowAt(rec->row);
+		if ((op == UNDO_INSERT) != undo)
+		{
+			char *s = text;
+			if (op == UNDO_ERASE)
+			{
+				s = malloc(rec->len);
+				for (k = 0; k < rec->len; k++)
+					s[k] = text[rec->len - 1 - k];
+			}
+			editorRowInsertString(row, rec->at, s, rec->len);
+			if (s != text)
+				free(s);
+		}
+		else
+			editorRowDeleteString(row, rec->at, rec->len);
+		editorDirtyRows(rec->row, rec->row + 1);
+		if ((op == UNDO_INSERT && !undo) || (op == UNDO_ERASE && undo))
+			E.cx += rec->len;
+	}
+	else if (op == UNDO_ROW)
+	{
+		if (undo)
+			editorDelRow(rec->row);
+		else
+			editorInsertRow(E.cy++, text, rec->len);
+	}
+	else if ((op == UNDO_SPLIT) == undo)
+	{
+		// joining is a backspace at the start of the next row
+		E.cy = rec->row + 1;
+		E.cx = 0;
+		editorDelChar();
+	}
+	else
+		editorInsertNewline();
+}
+
+/**
+ * Takes back the last step, a coalesced run of keys or a single key
+ * Costs as much as the change did, nothing is replayed from the start
+ */
+void editorUndo()
+{
+	if (editorReadOnly())
+		return;
+	if (U.top == 0)
+	{
+		editorSetStatusMessage("Nothing to undo");
+		return;
+	}
+	U.applying = 1;
+	struct undoRec *rec;
+	do
+	{
+		rec = editorUndoBefore(U.top);
+		editorUndoApply(rec, 1);
+		U.top -= editorUndoSize(rec->len);
+	} while (rec->op & UNDO_CHAIN);
+	U.applying = 0;
+	U.last = -1;
+}
+
+void editorRedo()
+{
+	if (editorReadOnly())
+		return;
+	if (U.top == U.len)
+	{
+		editorSetStatusMessage("Nothing to redo");
+		return;
+	}
+	U.applying = 1;
+	do
+	{
+		struct undoRec *rec = editorUndoAt(U.top);
+		editorUndoApply(rec, 0);
+		U.top += editorUndoSize(rec->len);
+	} while (U.top < U.len && (editorUndoAt(U.top)->op & UNDO_CHAIN));
+	U.applying = 0;
+	U.last = -1;
+}
+
+/*** file i/o ***/
+
+/**
+ * Opens and reads a file into the editor buffer
+ * @param filename: Path to the file to open
+ * Reads the file line by line
+ * Strips newline characters
+ * Adds each line to the editor's row buffer
+ */
+
+/**
+ * Writes n iovecs in full at *off, picking up after short writes
+ * Advances *off past them; returns 0, or -1 with errno set
+ */
+int editorWritev(int fd, struct iovec *iov, int n, off_t *off)
+{
+	while (n > 0)
+	{
+		ssize_t w = pwritev(fd, iov, n, *off);
+		if (w == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		*off += w;
+		while (n > 0 && (size_t)w >= iov->iov_len)
+		{
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Takes the chars and size of rows [from, to), with the gap flattened
+ * Rows may then come and go, the snapshot still says what to write
+ */
+struct saveRow *editorSnapshotRows(int from, int to)
+{
+	editorFlattenGap();
+	struct saveRow *rows = malloc((to > from ? to - from : 1) * sizeof(*rows));
+	int j;
+	for (j = from; j < to; j++)
+	{
+		erow *row = editorRowAt(j);
+		struct saveRow *s = &rows[j - from];
+		s->chars = row->u.heap.chars;
+		s->size = row->size;
+		if (row->flags & ROW_INLINE)
+		{
+			memcpy(s->text, row->u.text, row->size);
+			s->chars = s->text;
+		}
+	}
+	return rows;
+}
+
+/**
+ * Streams n snapshot rows to fd at offset off, each followed by a newline
+ * Rows go out in pwritev() batches of up to EDIT_SAVE_IOV pieces. Long
+ * rows go straight from their chars; runs of short ones are joined into
+ * an EDIT_SAVE_JOIN buffer first, so they don't cost two pieces a row
+ * Returns 0 and sets *len to the bytes written, or -1 with errno set
+ */
+int editorWriteRows(int fd, struct saveRow *rows, int nrows, off_t off, long long *len)
+{
+	struct iovec iov[EDIT_SAVE_IOV];
+	char *buf = malloc(EDIT_SAVE_JOIN);
+	size_t used = 0;
+	int n = 0;
+	int j = 0;
+	int ok = 1;
+	*len = 0;
+	while (ok && j < nrows)
+	{
+		if (n + 2 > EDIT_SAVE_IOV)
+		{
+			ok = editorWritev(fd, iov, n, &off) == 0;
+			n = 0;
+			used = 0;
+			continue;
+		}
+		size_t got;
+		int k = B->join(buf + used, EDIT_SAVE_JOIN - used, rows + j, nrows - j, &got);
+		if (k > 0)
+		{
+			iov[n].iov_base = buf + used;
+			iov[n++].iov_len = got;
+			used += got;
+			*len += got;
+			j += k;
+		}
+		else if (rows[j].size < EDIT_JOIN_ROW)
+		{
+			// the buffer is full, write it out to reuse it
+			ok = editorWritev(fd, iov, n, &off) == 0;
+			n = 0;
+			used = 0;
+		}
+		else
+		{
+			iov[n].iov_base = rows[j].chars;
+			iov[n++].iov_len = rows[j].size;
+			iov[n].iov_base = "\n";
+			iov[n++].iov_len = 1;
+			*len += rows[j].size + 1;
+			j++;
+		}
+	}
+	if (ok)
+		ok = editorWritev(fd, iov, n, &off) == 0;
+	free(buf);
+	return ok ? 0 : -1;
+}
+
+/**
+ * editorWriteRows() for rows [from, to) of the buffer as it is now
+ */
+int editorWriteRange(int fd, int from, int to, off_t off)
+{
+	struct saveRow *rows = editorSnapshotRows(from, to);
+	long long len;
+	int ret = editorWriteRows(fd, rows, to - from, off, &len);
+	free(rows);
+	return ret;
+}
+
+/**
+ * Moves len bytes of fd from offset from to offset to
+ * Copies through an EDIT_SAVE_CHUNK buffer, from the end when moving up
+ * so overlapping ranges are never read after being overwritten
+ * Returns 0, or -1 with errno set
+ */
+int editorMoveBytes(int fd, off_t from, off_t to, long long len)
+{
+	char *buf = malloc(EDIT_SAVE_CHUNK);
+	long long done = 0;
+	while (done < len)
+	{
+		long long n = len - done < EDIT_SAVE_CHUNK ? len - done : EDIT_SAVE_CHUNK;
+		long long at = to > from ? len - done - n : done;
+		long long got = 0;
+		while (got < n)
+		{
+			ssize_t r = pread(fd, buf + got, n - got, from + at + got);
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r <= 0)
+			{
+				if (r == 0)
+					errno = EIO; // the file is shorter than it was mapped
+				free(buf);
+				return -1;
+			}
+			got += r;
+		}
+		struct iovec iov = {buf, n};
+		off_t off = to + at;
+		if (editorWritev(fd, &iov, 1, &off) == -1)
+		{
+			free(buf);
+			return -1;
+		}
+		done += n;
+	}
+	free(buf);
+	return 0;
+}
+
+/**
+ * Lists a mapping of the file st describes, with one reference
+ */
+struct fileMap *editorMapAdd(char *map, struct stat *st)
+{
+	struct fileMap *m = calloc(1, sizeof(struct fileMap));
+	m->refs = 1;
+	m->map = map;
+	m->size = st->st_size;
+	m->dev = st->st_dev;
+	m->ino = st->st_ino;
+	m->mtime = st->st_mtim;
+	m->next = V.maps;
+	V.maps = m;
+	return m;
+}
+
+/**
+ * Maps the file open on fd read-only, or takes another reference to
+ * the mapping of it some buffer already has, if the file hasn't changed
+ * since. Returns NULL if it can't be mapped
+ */
+struct fileMap *editorMapFile(int fd, struct stat *st)
+{
+	struct fileMap *m;
+	for (m = V.maps; m; m = m->next)
+		if (m->dev == st->st_dev && m->ino == st->st_ino && m->size == (size_t)st->st_size &&
+				m->mtime.tv_sec == st->st_mtim.tv_sec && m->mtime.tv_nsec == st->st_mtim.tv_nsec)
+		{
+			m->refs++;
+			return m;
+		}
+	char *map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	return editorMapAdd(map, st);
+}
+
+/**
+ * Drops a reference, unmapping the file with the last one
+ */
+void editorMapRelease(struct fileMap *m)
+{
+	if (m == NULL || --m->refs > 0)
+		return;
+	if (m->marks)
+	{
+		__atomic_store_n(&m->cancel, 1, __ATOMIC_RELAXED);
+		pthread_join(m->thread, NULL);
+		munmap(m->marks, m->markslen);
+	}
+	munmap(m->map, m->size);
+	struct fileMap **p = &V.maps;
+	while (*p != m)
+		p = &(*p)->next;
+	*p = m->next;
+	free(m);
+}
+
+/**
+ * Returns whether another buffer maps the file m does, this version of
+ * it or an older one; writing it in place would change their rows
+ */
+int editorMapShared(struct fileMap *m)
+{
+	if (m->refs > 1)
+		return 1;
+	struct fileMap *o;
+	for (o = V.maps; o; o = o->next)
+		if (o != m && o->dev == m->dev && o->ino == m->ino)
+			return 1;
+	return 0;
+}
+
+/**
+ * Loads a regular file by mapping it instead of reading it
+ * @param fd: Open descriptor of the file
+ * @param st: Its fstat(), kept to tell later if the file changed under us
+ * Scans for newlines with memchr, splices E.row once for the line count
+ * and points every row into the mapping until it is first edited
+ * Past EDIT_LOAD_BYTES only the first screenful is loaded here and the
+ * rest is left to editorLoadStart()
+ * Returns -1 if the file can't be mapped so the caller can fall back
+ */
+int editorOpenMapped(int fd, struct stat *st)
+{
+	size_t size = st->st_size;
+	if (size == 0)
+		return 0;
+	struct fileMap *m = editorMapFile(fd, st);
+	if (m == NULL)
+		return -1;
+	char *map = m->map;
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	char *end = map + size;
+	int limit = size < EDIT_LOAD_BYTES ? INT_MAX : E.screenrows > 0 ? E.screenrows : 1;
+	size_t k = limit;
+	char *stop = (char *)editorByteSkip(map, size, '\n', &k);
+	int lines = limit - k + (k > 0 && end[-1] != '\n');
+	char *p;
+
+	E.mapping = m;
+	E.map = map;
+	E.maplen = size;
+	int at = E.numrows;
+	editorSpliceRows(at, lines);
+
+	// saving in place needs each row to be exactly its line
+	int exact = 1;
+	p = map;
+	while (p < stop)
+	{
+		char *nl = memchr(p, '\n', end - p);
+		char *eol = nl ? nl : end;
+		char *next = nl ? nl + 1 : end;
+		while (eol > p && (eol[-1] == '\n' || eol[-1] == '\r'))
+			eol--;
+		if (nl == NULL || eol != nl)
+			exact = 0;
+
+		erow *row = editorRowAt(at++);
+		row->size = eol - p;
+		row->rsize = 0;
+		row->ntabs = 0;
+		row->u.heap.chars = p;
+		row->u.heap.render = NULL;
+		row->flags = ROW_MAPPED | ROW_NORENDER;
+		p = next;
+	}
+
+	E.ndirty = 0;
+	E.map_exact = exact && at == lines;
+	E.map_dev = st->st_dev;
+	E.map_ino = st->st_ino;
+	E.map_mtime = st->st_mtim;
+	if (stop < end)
+		editorLoadStart(stop - map);
+	return 0;
+}
+
+/**
+ * Queues a batch for the main loop, waiting while it is EDIT_LOAD_QUEUE
+ * behind so the batches never hold much more than the rows will
+ */
+void editorLoadQueue(struct loadBatch *b)
+{
+	pthread_mutex_lock(&L.lock);
+	while (L.threaded && L.queued >= EDIT_LOAD_QUEUE && !L.cancel)
+		pthread_cond_wait(&L.room, &L.lock);
+	if (L.tail)
+		L.tail->next = b;
+	else
+		L.head = b;
+	L.tail = b;
+	L.queued++;
+	pthread_cond_signal(&L.ready);
+	pthread_mutex_unlock(&L.lock);
+	editorWake();
+}
+
+/**
+ * Splits the file from L.from on into lines, a batch at a time
+ */
+void *editorLoader(void *arg)
+{
+	(void)arg;
+	char *end = E.map + E.maplen;
+	char *p = E.map + L.from;
+	int exact = 1;
+	struct loadBatch *b = NULL;
+	while (p < end && !__atomic_load_n(&L.cancel, __ATOMIC_RELAXED))
+	{
+		if (b == NULL)
+		{
+			b = malloc(sizeof(struct loadBatch));
+			b->next = NULL;
+			b->n = 0;
+		}
+		char *nl = memchr(p, '\n', end - p);
+		char *eol = nl ? nl : end;
+		char *next = nl ? nl + 1 : end;
+		while (eol > p && (eol[-1] == '\n' || eol[-1] == '\r'))
+			eol--;
+		if (nl == NULL || eol != nl)
+			exact = 0;
+		b->off[b->n] = p - E.map;
+		b->len[b->n++] = eol - p;
+		p = next;
+		if (b->n == EDIT_LOAD_BATCH || p == end)
+		{
+			b->end = p - E.map;
+			editorLoadQueue(b);
+			b = NULL;
+		}
+	}
+	free(b);
+
+	pthread_mutex_lock(&L.lock);
+	L.done = 1;
+	L.done_exact = exact;
+	pthread_cond_signal(&L.ready);
+	pthread_mutex_unlock(&L.lock);
+	editorWake();
+	return NULL;
+}
+
+/**
+ * Leaves the rest of the mapped file from offset from to the loader
+ * Without a thread the loader runs right here instead
+ */
+void editorLoadStart(size_t from)
+{
+	pthread_mutex_init(&L.lock, NULL);
+	pthread_cond_init(&L.ready, NULL);
+	pthread_cond_init(&L.room, NULL);
+	L.from = from;
+	L.covered = from;
+	L.exact = E.map_exact;
+	L.head = L.tail = NULL;
+	L.queued = 0;
+	L.done = 0;
+	L.cancel = 0;
+	L.active = 1;
+	E.map_exact = 0;
+	L.threaded = 1;
+	if (pthread_create(&L.thread, NULL, editorLoader, NULL) != 0)
+	{
+		L.threaded = 0;
+		editorLoader(NULL);
+	}
+}
+
+/**
+ * Appends a batch of lines as mapped rows
+ * They are the file as it is on disk, so unlike other new rows they are
+ * not dirty and leave E.dirty alone
+ */
+void editorLoadAppend(struct loadBatch *b)
+{
+	int at = E.numrows;
+	editorSpliceRows(at, b->n);
+	int j;
+	for (j = 0; j < b->n; j++)
+	{
+		erow *row = editorRowAt(at + j);
+		row->size = b->len[j];
+		row->rsize = 0;
+		row->ntabs = 0;
+		row->u.heap.chars = E.map + b->off[j];
+		row->u.heap.render = NULL;
+		row->flags = ROW_MAPPED | ROW_NORENDER;
+	}
+	L.covered = b->end;
+
+	// take back the range the splice marked, it comes last
+	struct rowRange *r = &E.dirty_rows[E.ndirty - 1];
+	if (r->lo >= at)
+		E.ndirty--;
+	else
+		r->hi = at;
+}
+
+/**
+ * Ends the load once the loader's last batch is in
+ */
+void editorLoadEnd()
+{
+	if (L.threaded)
+		pthread_join(L.thread, NULL);
+	pthread_mutex_destroy(&L.lock);
+	pthread_cond_destroy(&L.ready);
+	pthread_cond_destroy(&L.room);
+	E.map_exact = L.exact && L.done_exact;
+	L.active = 0;
+}
+
+/**
+ * Appends the batches the loader has queued since the last call
+ * @param wait: Nonzero to wait for one if none is queued yet
+ */
+void editorLoadTake(int wait)
+{
+	pthread_mutex_lock(&L.lock);
+	while (wait && L.head == NULL && !L.done)
+		pthread_cond_wait(&L.ready, &L.lock);
+	struct loadBatch *b = L.head;
+	int done = L.done;
+	L.head = L.tail = NULL;
+	L.queued = 0;
+	pthread_cond_signal(&L.room);
+	pthread_mutex_unlock(&L.lock);
+
+	while (b)
+	{
+		struct loadBatch *next = b->next;
+		editorLoadAppend(b);
+		free(b);
+		b = next;
+	}
+	if (done)
+		editorLoadEnd();
+}
+
+/**
+ * Takes in what the loader has found so far, if a file is loading
+ */
+void editorLoadPoll()
+{
+	if (L.active)
+		editorLoadTake(0);
+}
+
+/**
+ * Waits for the loader until there are rows rows or the file is all in
+ */
+void editorLoadUntil(int rows)
+{
+	while (L.active && E.numrows < rows)
+		editorLoadTake(1);
+}
+
+/**
+ * Stops the loader and drops the batches it queued, leaving the rows
+ * loaded so far for editorCloseFile() to remove
+ */
+void editorLoadClose()
+{
+	if (!L.active)
+		return;
+	pthread_mutex_lock(&L.lock);
+	__atomic_store_n(&L.cancel, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&L.room);
+	pthread_mutex_unlock(&L.lock);
+	if (L.threaded)
+		pthread_join(L.thread, NULL);
+	L.threaded = 0;
+	while (L.head)
+	{
+		struct loadBatch *next = L.head->next;
+		free(L.head);
+		L.head = next;
+	}
+	L.tail = NULL;
+	editorLoadEnd();
+}
+
+/**
+ * Returns the last row the cursor can go to
+ * That is the empty line past the end, unless the end is still growing
+ */
+int editorLastRow()
+{
+	if (L.active || (W.active && !__atomic_load_n(&E.mapping->done, __ATOMIC_ACQUIRE)))
+		return E.numrows - 1;
+	return E.numrows;
+}
+
+/**
+ * Counts the lines of a huge file, leaving a mark every EDIT_HUGE_STRIDE
+ * Publishes progress every EDIT_HUGE_PUBLISH lines and wakes the main
+ * loop to pick it up, see editorHugePoll()
+ * @param arg: The fileMap to index
+ */
+void *editorHugeIndexer(void *arg)
+{
+	struct fileMap *m = arg;
+	char *end = m->map + m->size;
+	char *p = m->map;
+	int line = 0;
+	int published = 0;
+	while (p < end && line < INT_MAX - EDIT_HUGE_STRIDE &&
+				 !__atomic_load_n(&m->cancel, __ATOMIC_RELAXED))
+	{
+		// a checkpoint's worth of lines at a time
+		size_t k = EDIT_HUGE_STRIDE;
+		p = (char *)editorByteSkip(p, end - p, '\n', &k);
+		if (k > 0)
+		{
+			// the end, and a last line without a newline counts too
+			line += EDIT_HUGE_STRIDE - k + (end[-1] != '\n');
+			break;
+		}
+		line += EDIT_HUGE_STRIDE;
+		m->marks[line / EDIT_HUGE_STRIDE] = p - m->map;
+		if (line - published >= EDIT_HUGE_PUBLISH)
+		{
+			published = line;
+			__atomic_store_n(&m->scanned, (size_t)(p - m->map), __ATOMIC_RELAXED);
+			__atomic_store_n(&m->lines, line, __ATOMIC_RELEASE);
+			editorWake();
+		}
+	}
+	__atomic_store_n(&m->scanned, (size_t)(p - m->map), __ATOMIC_RELAXED);
+	__atomic_store_n(&m->lines, line, __ATOMIC_RELEASE);
+	__atomic_store_n(&m->done, 1, __ATOMIC_RELEASE);
+	editorWake();
+	return NULL;
+}
+
+/**
+ * Starts indexing the file m maps for huge mode
+ * Returns -1 if that can't be done
+ */
+int editorHugeIndex(struct fileMap *m)
+{
+	// room for a mark per EDIT_HUGE_STRIDE one-byte lines, but only the
+	// pages the indexer writes to are ever backed
+	size_t markslen = (m->size / EDIT_HUGE_STRIDE + 2) * sizeof(size_t);
+	size_t *marks = mmap(NULL, markslen, PROT_READ | PROT_WRITE,
+											 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (marks == MAP_FAILED)
+		return -1;
+	m->marks = marks;
+	m->markslen = markslen;
+	m->lines = 0;
+	m->scanned = 0;
+	m->done = 0;
+	m->cancel = 0;
+	if (pthread_create(&m->thread, NULL, editorHugeIndexer, m) != 0)
+	{
+		munmap(marks, markslen);
+		m->marks = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Opens a file too big for a row per line read-only, in huge mode
+ * Maps it and starts the indexer, rows appear as it publishes them
+ * A file another buffer has open in huge mode shares its index
+ * Returns -1 if that can't be done so the caller can load it as usual
+ */
+int editorOpenHuge(int fd, struct stat *st)
+{
+	struct fileMap *m = editorMapFile(fd, st);
+	if (m == NULL)
+		return -1;
+	if (m->marks == NULL && editorHugeIndex(m) == -1)
+	{
+		editorMapRelease(m);
+		return -1;
+	}
+
+	// buffers each have a W, so the count is kept here: a cursor set in
+	// one buffer's file must not match in another's
+	static int gen;
+	E.mapping = m;
+	E.map = m->map;
+	E.maplen = m->size;
+	W.gen = ++gen;
+	W.slots = malloc(EDIT_HUGE_CACHE * sizeof(struct hugeSlot));
+	W.buckets = malloc(2 * EDIT_HUGE_CACHE * sizeof(int));
+	memset(W.buckets, -1, 2 * EDIT_HUGE_CACHE * sizeof(int));
+	W.nslots = 0;
+	W.head = W.tail = -1;
+	W.active = 1;
+	E.store = &hugeStore;
+	E.map_exact = 0;
+	return 0;
+}
+
+/**
+ * Takes in the lines the indexer published since the last call
+ */
+void editorHugePoll()
+{
+	if (!W.active)
+		return;
+	int lines = __atomic_load_n(&E.mapping->lines, __ATOMIC_ACQUIRE);
+	if (lines != E.numrows)
+	{
+		editorDamageRows(E.numrows);
+		E.numrows = lines;
+	}
+}
+
+/**
+ * Stops the indexer and drops what huge mode keeps besides the mapping
+ */
+void editorHugeClose()
+{
+	if (!W.active)
+		return;
+	free(W.slots);
+	free(W.buckets);
+	W.slots = NULL;
+	W.buckets = NULL;
+	W.active = 0;
+}
+
+/**
+ * Stops following the file
+ */
+void editorFollowStop()
+{
+	if (!T.active)
+		return;
+	close(T.ifd);
+	close(T.fd);
+	T.active = 0;
+	T.pending = 0;
+}
+
+/**
+ * Starts following the open file from where the rows end
+ * A mapped buffer holds the file as it was mapped, so anything written
+ * since is caught up on the first read; otherwise it starts at the
+ * current end
+ */
+void editorFollowStart()
+{
+	if (E.filename == NULL)
+	{
+		editorSetStatusMessage("No file to follow");
+		return;
+	}
+	if (W.active)
+	{
+		editorSetStatusMessage("Huge files can't be followed");
+		return;
+	}
+	editorLoadUntil(INT_MAX);
+
+	int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1)
+	{
+		if (fd != -1)
+			close(fd);
+		editorSetStatusMessage("Can't follow: %s", strerror(errno));
+		return;
+	}
+	int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd == -1 || inotify_add_watch(ifd, E.filename, IN_MODIFY) == -1)
+	{
+		editorSetStatusMessage("Can't follow: %s", strerror(errno));
+		if (ifd != -1)
+			close(ifd);
+		close(fd);
+		return;
+	}
+
+	T.fd = fd;
+	T.ifd = ifd;
+	T.off = E.map ? (off_t)E.maplen : st.st_size;
+	char last = '\n';
+	T.open = E.numrows > 0 && T.off > 0 && pread(fd, &last, 1, T.off - 1) == 1 && last != '\n';
+	T.active = 1;
+	T.pending = 1; // for what was written before the watch
+	T.due = 0;
+	editorSetStatusMessage("Following %s, Ctrl-T to stop", E.filename);
+}
+
+/**
+ * Appends up to EDIT_FOLLOW_MAX new bytes of the followed file as rows
+ * The first of them finish the last row if its line was still open, and
+ * whole lines go in with editorInsertRows(). These rows are the file's,
+ * so they leave E.dirty alone, and a cursor at the end stays at the end
+ * Returns 1 if there is more to read
+ */
+int editorFollowRead()
+{
+	struct stat st;
+	if (fstat(T.fd, &st) == -1)
+		return 0;
+	if (st.st_size < T.off)
+	{
+		editorFollowStop();
+		editorSetStatusMessage("File was truncated, stopped following");
+		return 0;
+	}
+	size_t want = st.st_size - T.off;
+	if (want == 0)
+		return 0;
+	if (want > EDIT_FOLLOW_MAX)
+		want = EDIT_FOLLOW_MAX;
+	char *buf = malloc(want);
+	ssize_t n = pread(T.fd, buf, want, T.off);
+	if (n <= 0)
+	{
+		free(buf);
+		return 0;
+	}
+	T.off += n;
+
+	// at the end means on the last row or the empty line past it
+	int dirty = E.dirty;
+	int tail = E.cy >= E.numrows - 1 ? E.numrows - E.cy : -1;
+	char *p = buf;
+	char *end = buf + n;
+	if (T.open)
+	{
+		char *nl = memchr(p, '\n', end - p);
+		char *eol = nl ? nl : end;
+		if (nl && eol > p && eol[-1] == '\r')
+			eol--;
+		erow *row = editorRowAt(E.numrows - 1);
+		if (eol > p)
+			editorRowAppendString(row, p, eol - p);
+		else if (nl && row->size > 0 && editorRowText(row)[row->size - 1] == '\r')
+			editorRowDeleteString(row, row->size - 1, 1); // \r\n split across reads
+		editorDirtyRows(E.numrows - 1, E.numrows);
+		T.open = nl == NULL;
+		p = nl ? nl + 1 : end;
+	}
+
+	char *lines[EDIT_OPEN_BATCH];
+	size_t lens[EDIT_OPEN_BATCH];
+	int k = 0;
+	while (p < end)
+	{
+		char *nl = memchr(p, '\n', end - p);
+		char *eol = nl ? nl : end;
+		if (nl && eol > p && eol[-1] == '\r')
+			eol--;
+		lines[k] = p;
+		lens[k] = eol - p;
+		if (++k == EDIT_OPEN_BATCH)
+		{
+			editorInsertRows(E.numrows, lines, lens, k);
+			k = 0;
+		}
+		T.open = nl == NULL;
+		p = nl ? nl + 1 : end;
+	}
+	editorInsertRows(E.numrows, lines, lens, k);
+	free(buf);
+	E.dirty = dirty;
+
+	if (tail >= 0)
+	{
+		E.cy = E.numrows - tail;
+		E.cx = 0;
+	}
+	return T.off < st.st_size;
+}
+
+/**
+ * Reads what was written to a followed file, once its tick is due
+ */
+void editorFollowPoll()
+{
+	if (!T.active || !T.pending)
+		return;
+	long long now = editorNowMs();
+	if (now < T.due)
+		return;
+	T.pending = editorFollowRead();
+	T.due = now + EDIT_FOLLOW_MS;
+}
+
+/**
+ * Points every row into a new mapping of the file it was just saved to
+ * The rows with a newline each are the file, so edited rows drop their
+ * own chars and the buffer is back to costing only its row structs
+ */
+void editorUseMapping(struct fileMap *m)
+{
+	char *map = m->map;
+	editorFlattenGap();
+	size_t off = 0;
+	int j;
+	for (j = 0; j < E.numrows; j++)
+	{
+		erow *row = editorRowAt(j);
+		if (row->flags & ROW_INLINE)
+			row->u.heap.render = NULL;
+		else if (!(row->flags & ROW_MAPPED))
+			editorHeapFree(row->u.heap.chars);
+		row->u.heap.chars = map + off;
+		row->flags = (row->flags & ~ROW_INLINE) | ROW_MAPPED;
+		off += row->size + 1;
+	}
+	editorMapRelease(E.mapping);
+	E.mapping = m;
+	E.map = map;
+	E.maplen = m->size;
+	E.ndirty = 0;
+	E.map_exact = 1;
+	E.map_dev = m->dev;
+	E.map_ino = m->ino;
+	E.map_mtime = m->mtime;
+}
+
+/**
+ * Empties the buffer, as when the file is closed
+ * Row chars and renders all live in the row heap, so rather than freeing
+ * rows one by one the heap is dropped whole
+ */
+void editorCloseFile()
+{
+	editorSaveWait();
+	editorFollowStop();
+	editorLoadClose();
+	editorHugeClose();
+	if (E.numrows > 0)
+		editorRemoveRows(0, E.numrows);
+	editorHeapReset();
+	E.store = &flatStore;
+	E.gaprow = -1;
+	E.cx = E.cy = 0;
+	E.rowoff = E.coloff = 0;
+	editorMapRelease(E.mapping);
+	E.mapping = NULL;
+	E.map = NULL;
+	E.maplen = 0;
+	E.map_exact = 0;
+	E.ndirty = 0;
+	E.dirty = 0;
+	U.len = U.top = 0;
+	U.last = -1;
+}
+
+void editorOpen(char *filename)
+{
+	EDIT_PERF_SCOPE(PERF_OPEN);
+	editorCloseFile();
+	free(E.filename);
+	E.filename = strdup(filename);
+	editorSelectSyntaxHighlight();
+
+	int fd = open(filename, O_RDONLY);
+	if (fd != -1)
+	{
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+				((st.st_size >= EDIT_HUGE_BYTES && editorOpenHuge(fd, &st) == 0) ||
+				 editorOpenMapped(fd, &st) == 0))
+		{
+			close(fd);
+			E.dirty = 0;
+			return;
+		}
+		close(fd);
+	}
+
+	FILE *fp = fopen(filename, "r");
+	if (!fp)
+		die("fopen");
+
+	char *lines[EDIT_OPEN_BATCH];
+	size_t lens[EDIT_OPEN_BATCH];
+	int n = 0;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+
+	// lines are handed to editorInsertRows() in batches of EDIT_OPEN_BATCH
+	while ((linelen = getline(&line, &linecap, fp)) != -1)
+	{
+		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+			linelen--;
+
+		lines[n] = line;
+		lens[n] = linelen;
+		line = NULL;
+		linecap = 0;
+		if (++n == EDIT_OPEN_BATCH)
+		{
+			editorInsertRows(E.numrows, lines, lens, n);
+			while (n)
+				free(lines[--n]);
+		}
+	}
+	editorInsertRows(E.numrows, lines, lens, n);
+	while (n)
+		free(lines[--n]);
+
+	free(line);
+	fclose(fp);
+	E.ndirty = 0;
+	E.dirty = 0;
+}
+
+/**
+ * Byte length of rows [from, to) once saved, a newline after each
+ */
+long long editorRowBytes(int from, int to)
+{
+	long long len = 0;
+	int j;
+	for (j = from; j < to; j++)
+		len += editorRowAt(j)->size + 1;
+	return len;
+}
+
+/**
+ * Offset in the mapped file of clean row at, or of its end if at is
+ * numrows; -1 if the row isn't mapped so nothing is known about it
+ */
+long long editorMapOffset(int at)
+{
+	if (at == E.numrows)
+		return E.maplen;
+	erow *row = editorRowAt(at);
+	if (!(row->flags & ROW_MAPPED))
+		return -1;
+	return row->u.heap.chars - E.map;
+}
+
+/**
+ * Saves by writing only the dirty ranges over the file the rows map
+ * Ranges that kept their byte length are rewritten where they are. From
+ * the first one that didn't, the tail after the last range is moved once
+ * by the total change and the rows in between go out as one run
+ * Only done while the mapping is still the file at E.filename, no other
+ * buffer maps it and the writes come to less than the whole new file.
+ * Unlike the full rewrite an interrupted save leaves the file half written,
+ * though the rows it could have overwritten are copied first
+ * Returns 1 once the save is done or has failed and been reported, or 0
+ * to have the caller rewrite the whole file instead
+ */
+int editorSaveInPlace()
+{
+	if (E.map == NULL || !E.map_exact || editorMapShared(E.mapping))
+		return 0;
+	int fd = open(E.filename, O_RDWR);
+	if (fd == -1)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_dev != E.map_dev || st.st_ino != E.map_ino ||
+			st.st_size != (off_t)E.maplen || st.st_mtim.tv_sec != E.map_mtime.tv_sec ||
+			st.st_mtim.tv_nsec != E.map_mtime.tv_nsec)
+	{
+		close(fd);
+		return 0;
+	}
+	editorFlattenGap();
+
+	// where each range is in the file now, and how long it will be
+	struct rowRange *r = E.dirty_rows;
+	long long start[EDIT_SAVE_RANGES], end[EDIT_SAVE_RANGES], len[EDIT_SAVE_RANGES];
+	int first = E.ndirty;
+	int k;
+	for (k = 0; k < E.ndirty; k++)
+	{
+		start[k] = r[k].lo == 0 ? 0 : editorMapOffset(r[k].lo - 1);
+		if (r[k].lo > 0 && start[k] != -1)
+			start[k] += editorRowAt(r[k].lo - 1)->size + 1;
+		end[k] = editorMapOffset(r[k].hi);
+		if (start[k] == -1 || end[k] == -1 || end[k] < start[k])
+		{
+			close(fd);
+			return 0;
+		}
+		len[k] = editorRowBytes(r[k].lo, r[k].hi);
+		if (first == E.ndirty && len[k] != end[k] - start[k])
+			first = k;
+	}
+
+	long long cost = 0, run = 0, delta = 0, tail = 0;
+	for (k = 0; k < first; k++)
+		cost += len[k];
+	if (first < E.ndirty)
+	{
+		int last = E.ndirty - 1;
+		run = editorRowBytes(r[first].lo, r[last].hi);
+		delta = start[first] + run - end[last];
+		tail = E.maplen - end[last];
+		cost += run + (delta ? 2 * tail : 0);
+	}
+	long long size = E.maplen + delta;
+	if (size == 0 || cost >= size)
+	{
+		close(fd);
+		return 0;
+	}
+	if (delta > 0 && posix_fallocate(fd, E.maplen, delta) != 0)
+	{
+		close(fd);
+		return 0;
+	}
+	char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		if (delta > 0 && ftruncate(fd, E.maplen) == -1)
+			errno = 0;
+		close(fd);
+		return 0;
+	}
+
+	// rows about to be written over must not be read from the file, and
+	// neither may the tail being moved: if a write fails partway, every
+	// row still has its text for the full rewrite
+	for (k = 0; k < E.ndirty; k++)
+	{
+		int j;
+		int to = k < first ? r[k].hi : delta ? E.numrows : r[E.ndirty - 1].hi;
+		for (j = r[k].lo; j < to; j++)
+			editorRowOwn(editorRowAt(j));
+		if (k >= first)
+			break;
+	}
+
+	int ok = 1;
+	for (k = 0; ok && k < first; k++)
+		ok = editorWriteRange(fd, r[k].lo, r[k].hi, start[k]) == 0;
+	if (ok && first < E.ndirty)
+	{
+		int last = E.ndirty - 1;
+		ok = (delta == 0 || editorMoveBytes(fd, end[last], end[last] + delta, tail) == 0) &&
+				 editorWriteRange(fd, r[first].lo, r[last].hi, start[first]) == 0;
+	}
+	ok = ok && (delta >= 0 || ftruncate(fd, size) == 0) && fsync(fd) == 0 &&
+			 fstat(fd, &st) == 0;
+	if (!ok)
+	{
+		// the rows hold their own text, but the file no longer matches the
+		// mapping, so only rewrite it whole
+		int saved = errno;
+		munmap(map, size);
+		close(fd);
+		E.map_exact = 0;
+		editorSetStatusMessage("Can't save! %s, file on disk half written", strerror(saved));
+		return 1;
+	}
+
+	editorUseMapping(editorMapAdd(map, &st));
+	close(fd);
+	E.dirty = 0;
+	editorSetStatusMessage("%lld bytes written to disk in place", cost);
+	return 1;
+}
+
+/**
+ * Maps the file a full save just wrote in place of the old one
+ * Mapped rows otherwise keep the replaced inode alive, and only rows
+ * mapping the file itself can be saved in place next time
+ */
+void editorMapSaved(char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size == editorRowBytes(0, E.numrows))
+	{
+		struct fileMap *m = editorMapFile(fd, &st);
+		if (m)
+			editorUseMapping(m);
+	}
+	close(fd);
+}
+
+/**
+ * Writes the snapshot in S to a temp file and renames it over S.path
+ * Runs on the save thread, so it touches nothing but S; the rows go out
+ * about EDIT_SAVE_CHUNK bytes at a time so progress moves smoothly
+ */
+void *editorSaveWorker(void *arg)
+{
+	(void)arg;
+	char *tmp = malloc(strlen(S.path) + 8);
+	sprintf(tmp, "%s.XXXXXX", S.path);
+
+	/*
+	 * The new contents go to a temp file next to the target and replace it
+	 * with rename(), so a failed or interrupted save leaves the old file
+	 * whole. Mapped rows stay valid, they point into the old inode.
+	 */
+	int err = 0;
+	int fd = mkstemp(tmp);
+	if (fd == -1)
+		err = errno;
+	else
+	{
+		struct stat st;
+		if (stat(S.path, &st) == 0)
+		{
+			if (fchown(fd, st.st_uid, st.st_gid) == -1)
+				errno = 0; // not allowed to give it away, so it stays ours
+			fchmod(fd, st.st_mode & 07777);
+		}
+		else
+			fchmod(fd, S.mode);
+
+		off_t off = 0;
+		int j, n;
+		for (j = 0; j < S.nrows && !err; j += n)
+		{
+			// about EDIT_SAVE_CHUNK bytes at a time
+			long long bytes = 0;
+			n = 0;
+			while (j + n < S.nrows && bytes < EDIT_SAVE_CHUNK)
+				bytes += S.rows[j + n++].size + 1;
+			long long len;
+			if (editorWriteRows(fd, &S.rows[j], n, off, &len) == -1)
+				err = errno;
+			off += len;
+			__atomic_store_n(&S.written, (long long)off, __ATOMIC_RELAXED);
+		}
+		if (!err && fsync(fd) == -1)
+			err = errno;
+		if (close(fd) == -1 && !err)
+			err = errno;
+		if (!err && rename(tmp, S.path) == -1)
+			err = errno;
+
+		if (err)
+			unlink(tmp);
+		else
+		{
+			// make the rename itself durable
+			char *dir = strdup(S.path);
+			char *slash = strrchr(dir, '/');
+			if (slash)
+				*slash = '\0';
+			int dfd = open(slash ? (*dir ? dir : "/") : ".", O_RDONLY);
+			if (dfd != -1)
+			{
+				fsync(dfd);
+				close(dfd);
+			}
+			free(dir);
+		}
+	}
+	free(tmp);
+	S.err = err;
+	__atomic_store_n(&S.done, 1, __ATOMIC_RELEASE);
+	editorWake();
+	return NULL;
+}
+
+int editorSaveBusy()
+{
+	return S.running;
+}
+
+/**
+ * Wraps up a save whose writer has returned, on the main thread
+ * Releases the shared chars, then maps the new file if nothing was
+ * edited meanwhile; edits made during the save keep the buffer modified
+ */
+void editorSaveFinish()
+{
+	int j;
+	for (j = 0; j < E.numrows; j++)
+		editorRowAt(j)->flags &= ~ROW_SHARED;
+	while (S.norphans)
+		editorHeapFree(S.orphans[--S.norphans]);
+	free(S.rows);
+	S.rows = NULL;
+	S.running = 0;
+	editorPerfRecord(PERF_SAVE_WRITE, editorNowNs() - S.started);
+
+	if (S.err)
+		editorSetStatusMessage("Can't save! I/O error: %s", strerror(S.err));
+	else
+	{
+		if (E.dirty == S.dirty)
+			editorMapSaved(S.path);
+		E.dirty -= S.dirty;
+		editorSetStatusMessage("%lld bytes written to disk", S.total);
+	}
+	free(S.path);
+	S.path = NULL;
+}
+
+/**
+ * Shows the progress of a running save, and finishes it once written
+ * Called between keypresses, editorReadKey() makes sure that is often
+ */
+void editorSavePoll()
+{
+	if (!S.running)
+		return;
+	if (!__atomic_load_n(&S.done, __ATOMIC_ACQUIRE))
+	{
+		long long written = __atomic_load_n(&S.written, __ATOMIC_RELAXED);
+		int percent = S.total ? written * 100 / S.total : 0;
+		if (percent != S.percent)
+		{
+			S.percent = percent;
+			editorSetStatusMessage("Saving... %d%%", percent);
+		}
+		return;
+	}
+	pthread_join(S.thread, NULL);
+	editorSaveFinish();
+}
+
+/**
+ * Blocks until a running save is done, for when the editor exits
+ */
+void editorSaveWait()
+{
+	if (!S.running)
+		return;
+	pthread_join(S.thread, NULL);
+	editorSaveFinish();
+}
+
+void editorSave()
+{
+	EDIT_PERF_SCOPE(PERF_SAVE);
+	if (editorReadOnly())
+		return;
+	if (S.running)
+	{
+		editorSetStatusMessage("Still saving, %d%% written", S.percent < 0 ? 0 : S.percent);
+		return;
+	}
+	if (E.filename == NULL)
+	{
+		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+		if (E.filename == NULL)
+		{
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntaxHighlight();
+	}
+
+	// the whole file has to be in to be written out
+	editorLoadUntil(INT_MAX);
+	if (editorSaveInPlace())
+		return;
+
+	// write through a symlink instead of replacing it
+	S.path = realpath(E.filename, NULL);
+	if (S.path == NULL)
+		S.path = strdup(E.filename);
+	mode_t mask = umask(0);
+	umask(mask);
+	S.mode = 0644 & ~mask;
+
+	/*
+	 * Owned rows are marked shared rather than copied, so starting a save
+	 * costs one pass over the rows whatever their size
+	 */
+	S.rows = editorSnapshotRows(0, E.numrows);
+	S.nrows = E.numrows;
+	S.total = 0;
+	int j;
+	for (j = 0; j < E.numrows; j++)
+	{
+		erow *row = editorRowAt(j);
+		// the snapshot holds its own copy of inline rows
+		if (!(row->flags & (ROW_MAPPED | ROW_INLINE)))
+			row->flags |= ROW_SHARED;
+		S.total += row->size + 1;
+	}
+	S.dirty = E.dirty;
+	S.written = 0;
+	S.done = 0;
+	S.percent = -1;
+	S.running = 1;
+	S.started = editorNowNs();
+
+	if (pthread_create(&S.thread, NULL, editorSaveWorker, NULL) != 0)
+	{
+		editorSaveWorker(NULL);
+		editorSaveFinish();
+		return;
+	}
+	editorSavePoll();
+}
+
+/*** regex ***/
+
+/*
+ * Supports literals, ., [] classes with ranges and ^ negation, the
+ * \d \w \s escapes, ^ $ anchors, * + ? repeats, | and () groups.
+ * Patterns are parsed to a tree, compiled to an NFA program, and matched
+ * by a DFA built from the program lazily, so matching is linear in the
+ * text whatever the pattern.
+ */
+
+enum reNodeType
+{
+	RN_CLASS,
+	RN_CAT,
+	RN_ALT,
+	RN_STAR,
+	RN_PLUS,
+	RN_QUEST,
+	RN_BOL,
+	RN_EOL,
+	RN_EMPTY
+};
+
+struct reNode
+{
+	int type;
+	struct reNode *l, *r;
+	unsigned char set[32];
+};
+
+struct reNode *reNewNode(int type, struct reNode *l, struct reNode *r)
+{
+	struct reNode *n = calloc(1, sizeof(struct reNode));
+	n->type = type;
+	n->l = l;
+	n->r = r;
+	return n;
+}
+
+void reFreeNode(struct reNode *n)
+{
+	if (!n)
+		return;
+	reFreeNode(n->l);
+	reFreeNode(n->r);
+	free(n);
+}
+
+void reSetRange(unsigned char *set, int lo, int hi)
+{
+	int c;
+	for (c = lo; c <= hi; c++)
+		set[c >> 3] |= 1 << (c & 7);
+}
+
+/**
+ * Adds the bytes of a \d, \w or \s escape to set
+ * Returns 0 if c isn't one of them
+ */
+int reSetEscape(unsigned char *set, int c)
+{
+	switch (c)
+	{
+	case 'd':
+		reSetRange(set, '0', '9');
+		return 1;
+	case 'w':
+		reSetRange(set, '0', '9');
+		reSetRange(set, 'a', 'z');
+		reSetRange(set, 'A', 'Z');
+		reSetRange(set, '_', '_');
+		return 1;
+	case 's':
+		reSetRange(set, ' ', ' ');
+		reSetRange(set, '\t', '\r');
+		return 1;
+	}
+	return 0;
+}
+
+struct reNode *reParseAlt(const char **p);
+
+/**
+ * Parses the inside of a [] class, *p being just past the [
+ */
+struct reNode *reParseClass(const char **p)
+{
+	struct reNode *n = reNewNode(RN_CLASS, NULL, NULL);
+	const char *s = *p;
+	int negate = *s == '^';
+	if (negate)
+		s++;
+	int first = 1;
+	while (*s && (*s != ']' || first))
+	{
+		first = 0;
+		int lo = (unsigned char)*s++;
+		if (lo == '\\' && *s)
+		{
+			lo = (unsigned char)*s++;
+			if (reSetEscape(n->set, lo))
+				continue;
+		}
+		int hi = lo;
+		if (s[0] == '-' && s[1] && s[1] != ']')
+		{
+			hi = (unsigned char)s[1];
+			s += 2;
+			if (hi == '\\' && *s)
+				hi = (unsigned char)*s++;
+		}
+		if (lo <= hi)
+			reSetRange(n->set, lo, hi);
+	}
+	if (*s != ']')
+	{
+		free(n);
+		return NULL;
+	}
+	*p = s + 1;
+	if (negate)
+	{
+		int i;
+		for (i = 0; i < 32; i++)
+			n->set[i] = ~n->set[i];
+	}
+	return n;
+}
+
+struct reNode *reParseAtom(const char **p)
+{
+	const char *s = *p;
+	struct reNode *n;
+	switch (*s)
+	{
+	case '(':
+		*p = s + 1;
+		n = reParseAlt(p);
+		if (!n || **p != ')')
+		{
+			reFreeNode(n);
+			return NULL;
+		}
+		(*p)++;
+		return n;
+	case '[':
+		*p = s + 1;
+		return reParseClass(p);
+	case '^':
+		*p = s + 1;
+		return reNewNode(RN_BOL, NULL, NULL);
+	case '$':
+		*p = s + 1;
+		return reNewNode(RN_EOL, NULL, NULL);
+	case '*':
+	case '+':
+	case '?':
+		return NULL; // nothing to repeat
+	}
+
+	n = reNewNode(RN_CLASS, NULL, NULL);
+	if (*s == '.')
+	{
+		reSetRange(n->set, 0, 255);
+	}
+	else if (*s == '\\')
+	{
+		s++;
+		if (!*s)
+		{
+			free(n);
+			return NULL;
+		}
+		if (!reSetEscape(n->set, *s))
+			reSetRange(n->set, (unsigned char)*s, (unsigned char)*s);
+	}
+	else
+	{
+		reSetRange(n->set, (unsigned char)*s, (unsigned char)*s);
+	}
+	*p = s + 1;
+	return n;
+}
+
+struct reNode *reParseRepeat(const char **p)
+{
+	struct reNode *n = reParseAtom(p);
+	while (n && (**p == '*' || **p == '+' || **p == '?'))
+	{
+		int type = **p == '*' ? RN_STAR : **p == '+' ? RN_PLUS : RN_QUEST;
+		n = reNewNode(type, n, NULL);
+		(*p)++;
+	}
+	return n;
+}
+
+struct reNode *reParseCat(const char **p)
+{
+	struct reNode *n = reNewNode(RN_EMPTY, NULL, NULL);
+	while (**p && **p != '|' && **p != ')')
+	{
+		struct reNode *r = reParseRepeat(p);
+		if (!r)
+		{
+			reFreeNode(n);
+			return NULL;
+		}
+		n = reNewNode(RN_CAT, n, r);
+	}
+	return n;
+}
+
+struct reNode *reParseAlt(const char **p)
+{
+	struct reNode *n = reParseCat(p);
+	while (n && **p == '|')
+	{
+		(*p)++;
+		struct reNode *r = reParseCat(p);
+		if (!r)
+		{
+			reFreeNode(n);
+			return NULL;
+		}
+		n = reNewNode(RN_ALT, n, r);
+	}
+	return n;
+}
+
+int reAddInst(struct regex *re, int op, int *cap)
+{
+	if (re->len == *cap)
+	{
+		*cap = *cap ? *cap * 2 : 16;
+		re->prog = realloc(re->prog, sizeof(struct reInst) * *cap);
+	}
+	struct reInst *in = &re->prog[re->len];
+	memset(in, 0, sizeof(struct reInst));
+	in->op = op;
+	in->x = re->len + 1;
+	return re->len++;
+}
+
+void reEmit(struct regex *re, struct reNode *n, int *cap)
+{
+	int pc, j;
+	switch (n->type)
+	{
+	case RN_CLASS:
+		pc = reAddInst(re, RE_CLASS, cap);
+		memcpy(re->prog[pc].set, n->set, 32);
+		break;
+	case RN_BOL:
+		reAddInst(re, RE_BOL, cap);
+		break;
+	case RN_EOL:
+		reAddInst(re, RE_EOL, cap);
+		break;
+	case RN_CAT:
+		reEmit(re, n->l, cap);
+		reEmit(re, n->r, cap);
+		break;
+	case RN_ALT:
+		pc = reAddInst(re, RE_SPLIT, cap);
+		reEmit(re, n->l, cap);
+		j = reAddInst(re, RE_JMP, cap);
+		re->prog[pc].y = re->len;
+		reEmit(re, n->r, cap);
+		re->prog[j].x = re->len;
+		break;
+	case RN_STAR:
+		pc = reAddInst(re, RE_SPLIT, cap);
+		reEmit(re, n->l, cap);
+		j = reAddInst(re, RE_JMP, cap);
+		re->prog[j].x = pc;
+		re->prog[pc].y = re->len;
+		break;
+	case RN_PLUS:
+		j = re->len;
+		reEmit(re, n->l, cap);
+		pc = reAddInst(re, RE_SPLIT, cap);
+		re->prog[pc].x = j;
+		re->prog[pc].y = re->len;
+		break;
+	case RN_QUEST:
+		pc = reAddInst(re, RE_SPLIT, cap);
+		reEmit(re, n->l, cap);
+		re->prog[pc].y = re->len;
+		break;
+	}
+}
+
+/**
+ * Turns a tree around so it matches its text read backwards
+ */
+void reReverse(struct reNode *n)
+{
+	if (!n)
+		return;
+	if (n->type == RN_CAT)
+	{
+		struct reNode *l = n->l;
+		n->l = n->r;
+		n->r = l;
+	}
+	else if (n->type == RN_BOL)
+		n->type = RN_EOL;
+	else if (n->type == RN_EOL)
+		n->type = RN_BOL;
+	reReverse(n->l);
+	reReverse(n->r);
+}
+
+struct regex *reProgram(struct reNode *tree)
+{
+	static int ids = 0;
+	struct regex *re = calloc(1, sizeof(struct regex));
+	int cap = 0;
+	reEmit(re, tree, &cap);
+	reAddInst(re, RE_MATCH, &cap);
+	re->id = ++ids;
+	return re;
+}
+
+/**
+ * Compiles a pattern, returning NULL if it is malformed
+ * The reversed program is compiled with it, see editorRegexFind()
+ */
+struct regex *regexCompile(const char *pattern)
+{
+	const char *p = pattern;
+	struct reNode *tree = reParseAlt(&p);
+	if (!tree || *p != '\0')
+	{
+		reFreeNode(tree);
+		return NULL;
+	}
+
+	struct regex *re = reProgram(tree);
+	reReverse(tree);
+	re->rev = reProgram(tree);
+	reFreeNode(tree);
+	return re;
+}
+
+void regexFree(struct regex *re)
+{
+	if (!re)
+		return;
+	regexFree(re->rev);
+	free(re->prog);
+	free(re);
+}
+
+/**
+ * Adds the insts reachable from pc without consuming a byte to d->scratch
+ * RE_BOL is followed only at the start of the text and RE_EOL only at
+ * its end; without eol, RE_EOL insts are kept so the end can be tried later
+ */
+int dfaClosure(struct dfa *d, int pc, int n, int bol, int eol)
+{
+	int sp = 0;
+	d->stack[sp++] = pc;
+	while (sp > 0)
+	{
+		pc = d->stack[--sp];
+		if (d->mark[pc] == d->markgen)
+			continue;
+		d->mark[pc] = d->markgen;
+		struct reInst *in = &d->re->prog[pc];
+		switch (in->op)
+		{
+		case RE_SPLIT:
+			d->stack[sp++] = in->y;
+			d->stack[sp++] = in->x;
+			break;
+		case RE_JMP:
+			d->stack[sp++] = in->x;
+			break;
+		case RE_BOL:
+			if (bol)
+				d->stack[sp++] = in->x;
+			break;
+		case RE_EOL:
+			if (eol)
+				d->stack[sp++] = in->x;
+			else
+				d->scratch[n++] = pc;
+			break;
+		default:
+			d->scratch[n++] = pc;
+		}
+	}
+	return n;
+}
+
+int dfaCompareInt(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+void dfaFlush(struct dfa *d)
+{
+	int i;
+	for (i = 0; i < d->count; i++)
+		free(d->states[i].set);
+	d->count = 0;
+	memset(d->table, 0, sizeof(d->table));
+	d->start[0] = d->start[1] = -1;
+	d->flushes++;
+}
+
+/**
+ * Returns the state for the n pcs in d->scratch, adding it if it is new
+ * Adding to a full DFA flushes it first, which invalidates every state
+ */
+int dfaAdd(struct dfa *d, int n)
+{
+	qsort(d->scratch, n, sizeof(int), dfaCompareInt);
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < n; i++)
+		h = (h ^ d->scratch[i]) * 16777619u;
+
+	int mask = EDIT_REGEX_STATES * 2 - 1;
+	int slot;
+	for (slot = h & mask; d->table[slot]; slot = (slot + 1) & mask)
+	{
+		struct dfaState *s = &d->states[d->table[slot] - 1];
+		if (s->n == n && memcmp(s->set, d->scratch, sizeof(int) * n) == 0)
+			return d->table[slot] - 1;
+	}
+
+	if (d->count == EDIT_REGEX_STATES)
+	{
+		dfaFlush(d);
+		slot = h & mask;
+	}
+	struct dfaState *s = &d->states[d->count];
+	s->set = malloc(sizeof(int) * n + 1);
+	memcpy(s->set, d->scratch, sizeof(int) * n);
+	s->n = n;
+	s->accept = 0;
+	for (i = 0; i < n; i++)
+		if (d->re->prog[s->set[i]].op == RE_MATCH)
+			s->accept = 1;
+	// closing over the RE_EOL insts tells whether the end of text matches
+	s->eolaccept = s->accept;
+	d->markgen++;
+	int m = 0;
+	for (i = 0; i < n && !s->eolaccept; i++)
+		if (d->re->prog[s->set[i]].op == RE_EOL)
+			m = dfaClosure(d, s->set[i], m, 0, 1);
+	for (i = 0; i < m; i++)
+		if (d->re->prog[d->scratch[i]].op == RE_MATCH)
+			s->eolaccept = 1;
+	memset(s->next, -1, sizeof(s->next));
+	d->table[slot] = ++d->count;
+	return d->count - 1;
+}
+
+/**
+ * Points d at re with an empty cache, unless it already is
+ */
+void dfaReset(struct dfa *d, struct regex *re, int unanchored)
+{
+	if (d->re == re && d->id == re->id)
+		return;
+	dfaFlush(d);
+	free(d->states);
+	free(d->mid);
+	free(d->mark);
+	free(d->stack);
+	free(d->scratch);
+	d->re = re;
+	d->id = re->id;
+	d->unanchored = unanchored;
+	d->states = malloc(sizeof(struct dfaState) * EDIT_REGEX_STATES);
+	d->count = 0;
+	memset(d->table, 0, sizeof(d->table));
+	d->start[0] = d->start[1] = -1;
+	d->mark = calloc(re->len, sizeof(int));
+	d->markgen = 0;
+	// every pc can be on the stack once per parent pushing it, at most twice
+	d->stack = malloc(sizeof(int) * (re->len * 2 + 1));
+	d->scratch = malloc(sizeof(int) * (re->len * 2 + 1));
+	d->markgen++;
+	d->nmid = dfaClosure(d, 0, 0, 0, 0);
+	d->mid = malloc(sizeof(int) * d->nmid + 1);
+	memcpy(d->mid, d->scratch, sizeof(int) * d->nmid);
+}
+
+void dfaFree(struct dfa *d)
+{
+	if (!d->re)
+		return;
+	dfaFlush(d);
+	free(d->states);
+	free(d->mid);
+	free(d->mark);
+	free(d->stack);
+	free(d->scratch);
+	memset(d, 0, sizeof(struct dfa));
+}
+
+int dfaStart(struct dfa *d, int bol)
+{
+	if (d->start[bol] == -1)
+	{
+		d->markgen++;
+		int n = dfaClosure(d, 0, 0, bol, 0);
+		int s = dfaAdd(d, n);
+		d->start[bol] = s;
+	}
+	return d->start[bol];
+}
+
+/**
+ * Returns the state after reading byte c in state s
+ * The unanchored DFA also starts a new match at every byte
+ */
+int dfaStep(struct dfa *d, int s, unsigned char c)
+{
+	int t = d->states[s].next[c];
+	if (t != -1)
+		return t;
+
+	d->markgen++;
+	int n = 0;
+	int i;
+	struct dfaState *st = &d->states[s];
+	for (i = 0; i < st->n + (d->unanchored ? d->nmid : 0); i++)
+	{
+		int pc = i < st->n ? st->set[i] : d->mid[i - st->n];
+		struct reInst *in = &d->re->prog[pc];
+		if (in->op == RE_CLASS && (in->set[c >> 3] & (1 << (c & 7))))
+			n = dfaClosure(d, in->x, n, 0, 0);
+	}
+	int flushes = d->flushes;
+	t = dfaAdd(d, n);
+	if (d->flushes == flushes)
+		st->next[c] = t;
+	return t;
+}
+
+/**
+ * Returns whether a nonempty match starts at text[at], s being the state
+ * the unanchored DFA of the reversed regex is in once it has read the
+ * text backwards from its end down to text[at]
+ */
+int regexStartsAt(struct dfa *d, int s, int at)
+{
+	return d->states[s].accept || (at == 0 && d->states[s].eolaccept);
+}
+
+/*** find ***/
+
+/**
+ * Finds the first occurrence of needle in haystack
+ * Skips through the haystack with memchr for the needle's first byte and
+ * checks its last byte before comparing the rest
+ */
+char *editorMemFind(const char *h, int hlen, const char *needle, int nlen)
+{
+	if (nlen == 0)
+		return (char *)h;
+	if (hlen < nlen)
+		return NULL;
+	const char *end = h + hlen - nlen + 1;
+	const char *p = h;
+	while (p < end && (p = memchr(p, needle[0], end - p)) != NULL)
+	{
+		if (p[nlen - 1] == needle[nlen - 1] && memcmp(p, needle, nlen) == 0)
+			return (char *)p;
+		p++;
+	}
+	return NULL;
+}
+
+/**
+ * Finds the last occurrence of needle in haystack, like editorMemFind()
+ */
+char *editorMemFindLast(const char *h, int hlen, const char *needle, int nlen)
+{
+	if (hlen < nlen)
+		return NULL;
+	if (nlen == 0)
+		return (char *)h + hlen;
+	int len = hlen - nlen + 1;
+	const char *p;
+	while (len > 0 && (p = memrchr(h, needle[0], len)) != NULL)
+	{
+		if (p[nlen - 1] == needle[nlen - 1] && memcmp(p, needle, nlen) == 0)
+			return (char *)p;
+		len = p - h;
+	}
+	return NULL;
+}
+
+/**
+ * Finds where a nonempty match of a regex starts in text
+ * The reversed regex is run from the end of the text back, in one pass
+ * that passes every start, so finding one is linear in the text however
+ * long the matches are
+ */
+int editorRegexFind(struct findScanner *sc, struct regex *re, const char *text, int len, int off, int dir)
+{
+	struct dfa *d = &sc->rev;
+	dfaReset(d, re->rev, 1);
+	int s = dfaStart(d, 1);
+	int found = -1;
+	int at;
+	for (at = len - 1; at >= 0 && (dir < 0 || at >= off); at--)
+	{
+		s = dfaStep(d, s, text[at]);
+		if (!regexStartsAt(d, s, at))
+			continue;
+		if (dir > 0)
+			found = at;
+		else if (at < off)
+			return at;
+	}
+	return found;
+}
+
+/**
+ * Counts the places a nonempty match of a regex starts in text, in one
+ * pass of the reversed regex
+ */
+long editorRegexCount(struct findScanner *sc, struct regex *re, const char *text, int len)
+{
+	struct dfa *d = &sc->rev;
+	dfaReset(d, re->rev, 1);
+	int s = dfaStart(d, 1);
+	long n = 0;
+	int at;
+	for (at = len - 1; at >= 0; at--)
+	{
+		s = dfaStep(d, s, text[at]);
+		n += regexStartsAt(d, s, at);
+	}
+	return n;
+}
+
+/**
+ * Searches the chars of a row for the query of a level
+ * @param off: cx position to search from, INT_MAX for the end of the row
+ * @param dir: 1 for the first match at or after off, -1 for the last
+ *             match starting before off
+ * Returns the cx position of the match, or -1
+ * Tabs match as themselves, so no row is rendered for the search
+ */
+int editorRowSearch(erow *row, struct findLevel *lv, int off, int dir)
+{
+	editorRowFlatten(row);
+	char *text = editorRowText(row);
+	int size = row->size;
+	int qlen = strlen(lv->query);
+	int found;
+	if (lv->regex)
+	{
+		found = lv->re ? editorRegexFind(&lv->scan, lv->re, text, size, off, dir) : -1;
+	}
+	else
+	{
+		char *match;
+		if (dir > 0)
+			match = off > size ? NULL : editorMemFind(text + off, size - off, lv->query, qlen);
+		else
+		{
+			int len = off > size ? size : off - 1 + qlen;
+			if (len > size)
+				len = size;
+			match = off <= 0 ? NULL : editorMemFindLast(text, len, lv->query, qlen);
+		}
+		found = match ? match - text : -1;
+	}
+	return found;
+}
+
+/**
+ * Counts the occurrences of needle in haystack, overlapping ones included
+ * since the arrow keys visit those too
+ */
+long editorMemCount(const char *h, int hlen, const char *needle, int nlen)
+{
+	long n = 0;
+	const char *p;
+	while ((p = editorMemFind(h, hlen, needle, nlen)) != NULL)
+	{
+		n++;
+		hlen -= p + 1 - h;
+		h = p + 1;
+	}
+	return n;
+}
+
+/**
+ * Scans one chunk of a job's candidate rows
+ * Rows are read through peek() and searched as their chars, so no row
+ * is written and this can run on any thread while the rows don't change
+ */
+struct findChunk *editorFindScan(struct findJob *job, int index, struct findScanner *sc)
+{
+	int from = index * EDIT_FIND_CHUNK;
+	int to = from + EDIT_FIND_CHUNK < job->ncand ? from + EDIT_FIND_CHUNK : job->ncand;
+	struct findChunk *c = malloc(sizeof(struct findChunk));
+	c->index = index;
+	c->rows = malloc(sizeof(int) * (to - from));
+	c->n = 0;
+	c->matches = 0;
+
+	int i;
+	for (i = from; i < to; i++)
+	{
+		if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED))
+			break;
+		int r = job->cand ? job->cand[i] : i;
+		erow *row = E.store->peek(r);
+		char *text = editorRowText(row);
+		int len = row->size;
+		long m = job->re ? editorRegexCount(sc, job->re, text, len) : editorMemCount(text, len, job->query, job->qlen);
+		if (m)
+		{
+			c->rows[c->n++] = r;
+			c->matches += m;
+		}
+	}
+	return c;
+}
+
+void *editorFindWorker(void *arg)
+{
+	struct findScanner sc;
+	memset(&sc, 0, sizeof(sc));
+	(void)arg;
+
+	pthread_mutex_lock(&F.lock);
+	while (1)
+	{
+		while (!F.job || F.job->next == F.job->nchunks)
+			pthread_cond_wait(&F.work, &F.lock);
+		struct findJob *job = F.job;
+		int index = job->next++;
+		F.busy++;
+		pthread_mutex_unlock(&F.lock);
+
+		struct findChunk *c = editorFindScan(job, index, &sc);
+
+		pthread_mutex_lock(&F.lock);
+		c->next = F.results;
+		F.results = c;
+		if (--F.busy == 0)
+			pthread_cond_broadcast(&F.idle);
+		editorWake();
+	}
+	return NULL;
+}
+
+/**
+ * Starts the worker pool the first time a search needs it
+ * Returns the number of workers, 0 if none could be started
+ */
+int editorFindPool()
 {
-	if (at < 0 || at >= row->size)
-		return;
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
-	editorUpdateRow(row);
-	E.dirty++;
+	static int started = 0;
+	if (started)
+		return F.nthreads;
+	started = 1;
+
+	pthread_mutex_init(&F.lock, NULL);
+	pthread_cond_init(&F.work, NULL);
+	pthread_cond_init(&F.idle, NULL);
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+	if (n > EDIT_FIND_THREADS)
+		n = EDIT_FIND_THREADS;
+	while (F.nthreads < n)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, editorFindWorker, NULL) != 0)
+			break;
+		pthread_detach(thread);
+		F.nthreads++;
+	}
+	return F.nthreads;
 }
 
-void editorFreeRow(erow *row)
+int editorFindBusy()
 {
-	free(row->render);
-	free(row->chars);
+	return F.job_level != -1;
 }
 
-void editorDelRow(int at)
+/**
+ * Cancels the job the workers are running and waits for them to leave it
+ * Each worker finishes at most the row it is on, so this is quick
+ */
+void editorFindStop()
 {
-	if (at < 0 || at >= E.numrows)
+	if (F.job_level == -1)
 		return;
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-	E.numrows--;
-	E.dirty++;
-}
 
-/*** editor operations ***/
+	pthread_mutex_lock(&F.lock);
+	__atomic_store_n(&F.job->cancel, 1, __ATOMIC_RELAXED);
+	while (F.busy)
+		pthread_cond_wait(&F.idle, &F.lock);
+	struct findJob *job = F.job;
+	struct findChunk *c = F.results;
+	F.job = NULL;
+	F.results = NULL;
+	pthread_mutex_unlock(&F.lock);
 
-void editorInsertChar(int c)
-{
-	if (E.cy == E.numrows)
+	while (c)
 	{
-		editorInsertRow(E.numrows, "", 0);
+		struct findChunk *next = c->next;
+		free(c->rows);
+		free(c);
+		c = next;
 	}
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
+	free(job);
+	F.job_level = -1;
 }
 
-void editorInsertNewline()
+/**
+ * Drops the chunk results of a level that never finished
+ */
+void editorFindClearChunks(struct findLevel *lv)
 {
-	if (E.cx == 0)
-	{
-		editorInsertRow(E.cy, "", 0);
-	}
-	else
+	int i;
+	for (i = 0; lv->chunks && i < lv->nchunks; i++)
 	{
-		erow *row = &E.row[E.cy];
-		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+		if (lv->chunks[i])
+		{
+			free(lv->chunks[i]->rows);
+			free(lv->chunks[i]);
+		}
 	}
-	E.cy++;
-	E.cx = 0;
-}
-
-void editorRowAppendString(erow *row, char *s, size_t len)
-{
-	row->chars = realloc(row->chars, row->size + len + 1);
-	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	E.dirty++;
+	free(lv->chunks);
+	lv->chunks = NULL;
+	lv->chunks_done = 0;
+	lv->matches = 0;
 }
 
-void editorDelChar()
+/**
+ * Adds a chunk's results to a level
+ * Once every chunk is in, they are joined into the level's sorted rows
+ */
+void editorFindCollect(struct findLevel *lv, struct findChunk *c)
 {
-	if (E.cy == E.numrows)
-		return;
-	if (E.cx == 0 && E.cy == 0)
-		return;
-	erow *row = &E.row[E.cy];
-	if (E.cx > 0)
+	if (c)
 	{
-		editorRowDelChar(row, E.cx - 1);
-		E.cx--;
+		lv->chunks[c->index] = c;
+		lv->chunks_done++;
+		lv->matches += c->matches;
 	}
-	else
+	if (lv->chunks_done < lv->nchunks)
+		return;
+
+	int total = 0;
+	int i;
+	for (i = 0; i < lv->nchunks; i++)
+		total += lv->chunks[i]->n;
+	lv->n = total > EDIT_FIND_MAX_ROWS ? -1 : 0;
+	lv->rows = NULL;
+	if (lv->n == 0)
 	{
-		E.cx = E.row[E.cy - 1].size;
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		editorDelRow(E.cy);
-		E.cy--;
+		lv->rows = malloc(sizeof(int) * total + 1);
+		for (i = 0; i < lv->nchunks; i++)
+		{
+			memcpy(&lv->rows[lv->n], lv->chunks[i]->rows, sizeof(int) * lv->chunks[i]->n);
+			lv->n += lv->chunks[i]->n;
+		}
 	}
+	long matches = lv->matches;
+	editorFindClearChunks(lv);
+	lv->matches = matches;
+	lv->done = 1;
+	editorPerfRecord(PERF_FIND, editorNowNs() - lv->started);
 }
 
-/*** file i/o ***/
-
 /**
- * Opens and reads a file into the editor buffer
- * @param filename: Path to the file to open
- * Reads the file line by line
- * Strips newline characters
- * Adds each line to the editor's row buffer
+ * Scans the rows of the level for its query
+ * For a literal, only the rows of the longest finished shorter query are
+ * candidates; extending a regex can match rows the shorter one didn't,
+ * as with "a|" and "a|b", so a regex always scans every row
+ * One chunk or less is scanned right away; more goes to the workers
+ * and is picked up by editorFindDrain(), replacing any running job
  */
-
-char *editorRowsToString(int *buflen)
+void editorFindStart(int level)
 {
-	int totlen = 0;
-	int j;
-	for (j = 0; j < E.numrows; j++)
-		totlen += E.row[j].size + 1;
-	*buflen = totlen;
+	struct findLevel *lv = &F.levels[level];
+	struct findLevel *base = NULL;
+	int i;
+	for (i = level - 1; i >= 0 && !base && !lv->regex; i--)
+		if (F.levels[i].done && F.levels[i].n >= 0)
+			base = &F.levels[i];
 
-	char *buf = malloc(totlen);
-	char *p = buf;
-	for (j = 0; j < E.numrows; j++)
+	editorFindStop();
+	editorFindClearChunks(lv);
+
+	struct findJob *job = malloc(sizeof(struct findJob));
+	job->query = lv->query;
+	job->qlen = strlen(lv->query);
+	job->re = lv->re;
+	job->cand = base ? base->rows : NULL;
+	job->ncand = base ? base->n : E.numrows;
+	if (lv->regex && !lv->re)
+		job->ncand = 0;
+	job->nchunks = (job->ncand + EDIT_FIND_CHUNK - 1) / EDIT_FIND_CHUNK;
+	job->next = 0;
+	job->cancel = 0;
+	lv->done = 0;
+	lv->started = editorNowNs();
+	lv->nchunks = job->nchunks;
+	lv->chunks = calloc(job->nchunks + 1, sizeof(struct findChunk *));
+
+	if (job->nchunks <= 1 || editorFindPool() == 0)
 	{
-		memcpy(p, E.row[j].chars, E.row[j].size);
-		p += E.row[j].size;
-		*p = '\n';
-		p++;
+		for (i = 0; i < job->nchunks; i++)
+			editorFindCollect(lv, editorFindScan(job, i, &lv->scan));
+		if (job->nchunks == 0)
+			editorFindCollect(lv, NULL);
+		free(job);
+		return;
 	}
 
-	return buf;
+	pthread_mutex_lock(&F.lock);
+	F.job = job;
+	F.job_level = level;
+	pthread_cond_broadcast(&F.work);
+	pthread_mutex_unlock(&F.lock);
 }
 
-void editorOpen(char *filename)
+/**
+ * Collects the chunks the workers finished since the last call
+ */
+void editorFindDrain()
 {
-	free(E.filename);
-	E.filename = strdup(filename);
-
-	FILE *fp = fopen(filename, "r");
-	if (!fp)
-		die("fopen");
+	if (F.job_level == -1)
+		return;
 
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
+	pthread_mutex_lock(&F.lock);
+	struct findChunk *c = F.results;
+	F.results = NULL;
+	pthread_mutex_unlock(&F.lock);
 
-	while ((linelen = getline(&line, &linecap, fp)) != -1)
+	struct findLevel *lv = &F.levels[F.job_level];
+	while (c)
 	{
-		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-			linelen--;
-
-		editorInsertRow(E.numrows, line, linelen);
+		struct findChunk *next = c->next;
+		editorFindCollect(lv, c);
+		c = next;
 	}
+	if (lv->done)
+		editorFindStop();
+}
 
-	free(line);
-	fclose(fp);
-	E.dirty = 0;
+void editorFindPop()
+{
+	struct findLevel *lv = &F.levels[--F.depth];
+	if (F.job_level == F.depth)
+		editorFindStop();
+	editorFindClearChunks(lv);
+	free(lv->query);
+	free(lv->rows);
+	regexFree(lv->re);
+	dfaFree(&lv->scan.rev);
 }
 
-void editorSave()
+void editorFindReset()
 {
-	if (E.filename == NULL)
+	while (F.depth > 0)
+		editorFindPop();
+	F.pending = 0;
+}
+
+/**
+ * Returns the set of rows containing query, maybe still being scanned
+ * Reuses the set of the longest earlier query that is a prefix of this
+ * one and only rescans its rows, so each typed character narrows the
+ * previous match set instead of scanning the whole buffer again
+ */
+struct findLevel *editorFindLevel(char *query)
+{
+	int qlen = strlen(query);
+	while (F.depth > 0)
 	{
-		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-		if (E.filename == NULL)
+		struct findLevel *top = &F.levels[F.depth - 1];
+		int len = strlen(top->query);
+		if (len <= qlen && strncmp(top->query, query, len) == 0)
 		{
-			editorSetStatusMessage("Save aborted");
-			return;
+			if (len < qlen)
+				break;
+			// a newer query may have cancelled this one before it finished
+			if (!top->done && F.job_level != F.depth - 1)
+				editorFindStart(F.depth - 1);
+			return top;
 		}
+		editorFindPop();
 	}
 
-	int len;
-	char *buf = editorRowsToString(&len);
+	if (F.depth == F.cap)
+	{
+		F.cap = F.cap ? F.cap * 2 : 8;
+		F.levels = realloc(F.levels, sizeof(struct findLevel) * F.cap);
+	}
+	struct findLevel *lv = &F.levels[F.depth++];
+	lv->query = strdup(query);
+	lv->regex = F.regex;
+	lv->re = F.regex ? regexCompile(query) : NULL;
+	memset(&lv->scan, 0, sizeof(lv->scan));
+	lv->rows = NULL;
+	lv->n = 0;
+	lv->chunks = NULL;
+	editorFindStart(F.depth - 1);
+	return lv;
+}
 
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1)
+/**
+ * Finds the next match in direction dir, starting at (row, off)
+ * Only rows in the match set are visited, wrapping around the buffer
+ * Returns the row of the match and sets *match_off, or returns -1
+ */
+int editorFindFrom(struct findLevel *lv, int row, int off, int dir, int *match_off)
+{
+	int n = lv->n >= 0 ? lv->n : E.numrows;
+	if (n == 0)
+		return -1;
+
+	// k is the first candidate at or after row going forwards, or the last
+	// one at or before it going backwards
+	int lo = 0, hi = n;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		int r = lv->n >= 0 ? lv->rows[mid] : mid;
+		if (r < row || (dir < 0 && r == row))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	int k = dir > 0 ? lo : lo - 1;
+	k = (k % n + n) % n;
+
+	int t;
+	for (t = 0; t <= n; t++)
 	{
-		if (ftruncate(fd, len) != -1)
+		int idx = ((k + dir * t) % n + n) % n;
+		int r = lv->n >= 0 ? lv->rows[idx] : idx;
+		erow *erow = editorRowAt(r);
+		int from;
+		if (t == 0 && r == row)
+			from = off;
+		else if (t == n && r != row)
+			break; // only the cursor row has a part left to search
+		else
+			from = dir > 0 ? 0 : INT_MAX;
+		int m = editorRowSearch(erow, lv, from, dir);
+		if (m != -1)
 		{
-			if (write(fd, buf, len) == len)
-			{
-				close(fd);
-				free(buf);
-				E.dirty = 0;
-				editorSetStatusMessage("%d bytes written to disk", len);
-				return;
-			}
+			*match_off = m;
+			return r;
 		}
-		close(fd);
 	}
-
-	free(buf);
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+	return -1;
 }
 
-/*** find ***/
-
+/**
+ * Incremental search callback for editorPrompt()
+ * Typing moves to the first match at or after where the search started,
+ * arrow keys move to the next (right/down) or previous (left/up) match
+ * and Ctrl-R switches between literal and regex queries
+ * While the workers are still scanning, the move waits in F.pending and
+ * is made from the IDLE_KEY call that collects the last chunk
+ */
 void editorFindCallback(char *query, int key)
 {
 	if (key == '\r' || key == '\x1b')
 	{
+		editorFindReset();
 		return;
 	}
 
-	int i;
-	for (i = 0; i < E.numrows; i++)
+	if (key == CTRL_KEY('r'))
 	{
-		erow *row = &E.row[i];
-		char *match = strstr(row->render, query);
-		if (match)
-		{
-			E.cy = i;
-			E.cx = editorRowRxToCx(row, match - row->render);
-			E.rowoff = E.numrows;
-			break;
-		}
+		// the match sets of the other mode are no use, search again
+		editorFindReset();
+		F.regex = !F.regex;
+	}
+
+	if (query[0] == '\0')
+	{
+		editorFindReset();
+		E.cy = F.origin_cy;
+		E.cx = F.origin_cx;
+		return;
+	}
+
+	editorFindDrain();
+	if (key != IDLE_KEY)
+	{
+		editorFindLevel(query);
+		// an arrow press doesn't replace a pending jump for a new query
+		if (F.pending != ARROW_RIGHT && F.pending != ARROW_LEFT && F.pending != 0 &&
+				(key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP))
+			key = F.pending;
+		F.pending = key == ARROW_DOWN ? ARROW_RIGHT : key == ARROW_UP ? ARROW_LEFT : key;
+	}
+	struct findLevel *lv = &F.levels[F.depth - 1];
+	if (!F.pending || !lv->done)
+		return;
+	key = F.pending;
+	F.pending = 0;
+
+	int row, off;
+	int match;
+	if (key == ARROW_RIGHT)
+	{
+		row = F.match_row;
+		off = F.match_off + 1;
+		match = editorFindFrom(lv, row, off, 1, &off);
+	}
+	else if (key == ARROW_LEFT)
+	{
+		row = F.match_row;
+		off = F.match_off;
+		match = editorFindFrom(lv, row, off, -1, &off);
+	}
+	else
+	{
+		row = F.origin_cy;
+		off = F.origin_cx;
+		match = editorFindFrom(lv, row, off, 1, &off);
+	}
+
+	if (match != -1)
+	{
+		F.match_row = match;
+		F.match_off = off;
+		E.cy = match;
+		E.cx = off;
+		E.rowoff = E.numrows;
 	}
 }
 
+/**
+ * Starts a search from the cursor, for editorFindCallback() to run
+ */
+void editorFindBegin()
+{
+	F.origin_cy = F.match_row = E.cy;
+	F.origin_cx = E.cx;
+	F.match_off = 0;
+	editorFindReset();
+	// the search workers read chars directly, without going around the gap
+	editorFlattenGap();
+}
+
 void editorFind()
 {
 	int saved_cx = E.cx;
@@ -569,7 +6424,10 @@ void editorFind()
 	int saved_coloff = E.coloff;
 	int saved_rowoff = E.rowoff;
 
-	char *query = editorPrompt("Search: %s (ESC to cancel)", editorFindCallback);
+	editorFindBegin();
+	F.active = 1;
+	char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-R regex)", editorFindCallback);
+	F.active = 0;
 
 	if (query)
 	{
@@ -593,41 +6451,293 @@ void editorSetStatusMessage(const char *fmt, ...)
 	E.statusmsg_time = time(NULL);
 }
 
+/*** buffers ***/
+
+/**
+ * Puts the current buffer's state aside in b
+ */
+void editorBufferStash(struct editorBuffer *b)
+{
+	b->E = E;
+	b->H = H;
+	b->U = U;
+	b->W = W;
+	b->L = L;
+	b->T = T;
+	b->R = R;
+}
+
+/**
+ * Puts buffer b's state in place of the current one's, which must have
+ * been stashed; the terminal side of E stays as it is
+ */
+void editorBufferLoad(struct editorBuffer *b)
+{
+	struct editorConfig term = E;
+	E = b->E;
+	H = b->H;
+	U = b->U;
+	W = b->W;
+	L = b->L;
+	T = b->T;
+	R = b->R;
+
+	E.screenrows = term.screenrows;
+	E.screencols = term.screencols;
+	E.shadow = term.shadow;
+	E.out = term.out;
+	E.line = term.line;
+	E.drawn_rows = term.drawn_rows;
+	E.drawn_cols = term.drawn_cols;
+	E.drawn_rowoff = term.drawn_rowoff;
+	E.drawn_coloff = term.drawn_coloff;
+	memcpy(E.statusmsg, term.statusmsg, sizeof(E.statusmsg));
+	E.statusmsg_time = term.statusmsg_time;
+	E.wake[0] = term.wake[0];
+	E.wake[1] = term.wake[1];
+	E.winch = term.winch;
+	E.orig_termios = term.orig_termios;
+	// every line on the screen is the other buffer's
+	E.redraw_from = 0;
+}
+
+/**
+ * Brings the current buffer to rest so its state can be put aside
+ * The loader and a save work on the globals, so they finish first; a
+ * huge file's indexer works on its fileMap and keeps going
+ */
+void editorBufferSettle()
+{
+	editorSaveWait();
+	editorLoadUntil(INT_MAX);
+	editorFindReset();
+}
+
+/**
+ * Makes buffer i the one being edited
+ */
+void editorBufferSwitch(int i)
+{
+	if (i == V.current)
+		return;
+	editorBufferSettle();
+	editorBufferStash(&V.buffers[V.current]);
+	V.current = i;
+	editorBufferLoad(&V.buffers[i]);
+}
+
+/**
+ * Opens filename in a new buffer and switches to it
+ * The empty buffer the editor starts with is used if it is untouched
+ */
+void editorBufferOpen(char *filename)
+{
+	if (access(filename, R_OK) == -1)
+	{
+		editorSetStatusMessage("Can't open %.40s: %s", filename, strerror(errno));
+		return;
+	}
+	if (E.filename || E.dirty || E.numrows)
+	{
+		editorBufferSettle();
+		if (V.n == V.cap)
+		{
+			V.cap *= 2;
+			V.buffers = realloc(V.buffers, V.cap * sizeof(struct editorBuffer));
+		}
+		editorBufferStash(&V.buffers[V.current]);
+		V.current = V.n++;
+		editorInitBuffer();
+		E.redraw_from = 0;
+	}
+	editorOpen(filename);
+}
+
+/**
+ * Closes the current buffer and switches to the one before it
+ * Closing the only buffer leaves an empty one
+ */
+void editorBufferClose()
+{
+	editorFindReset();
+	editorCloseFile();
+	free(E.filename);
+	free(E.row);
+	free(E.hl);
+	free(E.hl_text);
+	free(H.slabs);
+	free(U.buf);
+	if (V.n == 1)
+	{
+		editorInitBuffer();
+		E.redraw_from = 0;
+		return;
+	}
+	V.n--;
+	memmove(&V.buffers[V.current], &V.buffers[V.current + 1],
+					(V.n - V.current) * sizeof(struct editorBuffer));
+	if (V.current > 0)
+		V.current--;
+	editorBufferLoad(&V.buffers[V.current]);
+}
+
+/**
+ * Returns how many buffers have unsaved changes
+ */
+int editorBufferDirty()
+{
+	int n = 0, j;
+	for (j = 0; j < V.n; j++)
+		if (j == V.current ? E.dirty : V.buffers[j].E.dirty)
+			n++;
+	return n;
+}
+
 /*** append buffer ***/
 
 struct abuf
 {
 	char *b;
 	int len;
+	int cap;
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
+
+/**
+ * Makes room for len more bytes in an append buffer
+ * Grows the capacity geometrically, so a buffer that is reset and reused
+ * every frame stops allocating once it has seen its largest frame
+ * Returns -1 if the buffer couldn't be grown
+ */
+int abReserve(struct abuf *ab, int len)
+{
+	if (ab->len + len <= ab->cap)
+		return 0;
+	int cap = ab->cap ? ab->cap * 2 : 256;
+	while (cap < ab->len + len)
+		cap *= 2;
+	char *new = realloc(ab->b, cap);
+	if (new == NULL)
+		return -1;
+	ab->b = new;
+	ab->cap = cap;
+	return 0;
+}
+
+/**
+ * Append buffer: Efficient string building for terminal output
+ * @param ab: Append buffer structure
+ * @param s: String to append
+ * @param len: Length of string
+ * Dynamically grows the buffer as needed
+ * Used to build the complete screen output before writing to terminal
+ */
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+	if (len <= 0 || abReserve(ab, len) == -1)
+		return;
+	memcpy(&ab->b[ab->len], s, len);
+	ab->len += len;
+}
+
+/**
+ * Appends n copies of the byte c, for runs of padding
+ */
+void abFill(struct abuf *ab, char c, int n)
+{
+	if (n <= 0 || abReserve(ab, n) == -1)
+		return;
+	memset(&ab->b[ab->len], c, n);
+	ab->len += n;
+}
+
+void abFree(struct abuf *ab)
+{
+	free(ab->b);
+	ab->b = NULL;
+	ab->len = ab->cap = 0;
+}
+
+/*** output ***/
 
 /**
- * Append buffer: Efficient string building for terminal output
- * @param ab: Append buffer structure
- * @param s: String to append
- * @param len: Length of string
- * Dynamically grows the buffer as needed
- * Used to build the complete screen output before writing to terminal
+ * Marks every screen line from file row at downwards for redrawing
+ * Used when rows are inserted or removed, since everything below moves,
+ * and for the whole screen when the view scrolls
+ * Edits within a row mark just that row, with ROW_DAMAGED
  */
-void abAppend(struct abuf *ab, const char *s, int len)
+void editorDamageRows(int at)
 {
-	char *new = realloc(ab->b, ab->len + len);
+	int y = at - E.drawn_rowoff;
+	if (y < 0)
+		y = 0;
+	if (y < E.redraw_from)
+		E.redraw_from = y;
+}
 
-	if (new == NULL)
+/**
+ * Queues screen line y for output if it differs from the last frame
+ * @param line: The new contents of the line, swapped into the shadow frame
+ */
+void editorDrawLine(struct abuf *ab, int y, struct abuf *line)
+{
+	struct abuf *old = &E.shadow[y];
+	if (old->len == line->len && memcmp(old->b, line->b, line->len) == 0)
 		return;
-	memcpy(&new[ab->len], s, len);
-	ab->b = new;
-	ab->len += len;
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+	abAppend(ab, buf, len);
+	abAppend(ab, line->b, line->len);
+
+	struct abuf tmp = *old;
+	*old = *line;
+	*line = tmp;
 }
 
-void abFree(struct abuf *ab)
+void editorReverseShadow(int from, int to)
 {
-	free(ab->b);
+	while (from < --to)
+	{
+		struct abuf tmp = E.shadow[from];
+		E.shadow[from++] = E.shadow[to];
+		E.shadow[to] = tmp;
+	}
 }
 
-/*** output ***/
+/**
+ * Shifts the text area on the terminal by delta lines
+ * Sets a scroll region (DECSTBM) over the text rows and deletes or
+ * inserts delta lines at its top, so the terminal moves what it already
+ * shows. The shadow frame and pending damage move the same way, leaving
+ * only the newly exposed lines (with an empty shadow) to be drawn.
+ */
+void editorScrollRegion(struct abuf *ab, int delta)
+{
+	int n = delta > 0 ? delta : -delta;
+	char buf[48];
+	int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[1;1H\x1b[%d%c\x1b[r",
+										 E.screenrows, n, delta > 0 ? 'M' : 'L');
+	abAppend(ab, buf, len);
+
+	// rotate the shadow lines by reversing both parts and then the whole,
+	// which keeps every line's buffer for reuse
+	int split = delta > 0 ? n : E.screenrows - n;
+	editorReverseShadow(0, split);
+	editorReverseShadow(split, E.screenrows);
+	editorReverseShadow(0, E.screenrows);
+	int y;
+	int first = delta > 0 ? E.screenrows - n : 0;
+	for (y = first; y < first + n; y++)
+		E.shadow[y].len = 0;
+
+	E.redraw_from -= delta;
+	if (E.redraw_from < 0)
+		E.redraw_from = 0;
+	if (E.redraw_from > E.screenrows)
+		E.redraw_from = E.screenrows;
+}
 
 /**
  * Handles vertical scrolling of the editor window
@@ -640,7 +6750,7 @@ void editorScroll()
 	E.rx = 0;
 	if (E.cy < E.numrows)
 	{
-		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+		E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
 	}
 
 	if (E.cy < E.rowoff)
@@ -660,12 +6770,73 @@ void editorScroll()
 	{
 		E.coloff = E.rx - E.screencols + 1;
 	}
+
+	// small vertical moves are handled by editorScrollRegion() instead
+	int delta = E.rowoff - E.drawn_rowoff;
+	if (E.coloff != E.drawn_coloff || delta >= E.screenrows || -delta >= E.screenrows)
+		E.redraw_from = 0;
+}
+
+/**
+ * Appends len chars of a tab-free row starting at at
+ * The gap row is drawn in two pieces rather than flattened
+ */
+void editorDrawRowChars(struct abuf *ab, erow *row, int at, int len)
+{
+	if (len <= 0 || !(row->flags & ROW_GAP) || at + len <= E.gap)
+	{
+		abAppend(ab, &editorRowText(row)[at], len);
+		return;
+	}
+	if (at < E.gap)
+	{
+		abAppend(ab, &row->u.heap.chars[at], E.gap - at);
+		len -= E.gap - at;
+		at = E.gap;
+	}
+	abAppend(ab, &row->u.heap.chars[at + E.gaplen], len);
+}
+
+/**
+ * Appends len columns from E.coloff of a row in the colors of E.syntax
+ * The row is lexed only a little past the screen edge, enough for a
+ * keyword cut by it, and SGR escapes are only written where the color
+ * changes, with the default restored at the end
+ */
+void editorDrawRowHighlighted(struct abuf *ab, erow *row, int filerow, int len)
+{
+	int open = filerow > 0 && (editorRowAt(filerow - 1)->flags & ROW_COMMENT);
+	editorHlReserve(row->rsize);
+	const char *text = (row->flags & ROW_TABS) ? row->u.heap.render : editorHlText(row);
+	int end = E.coloff + len;
+	int n = end + EDIT_HL_LOOKAHEAD < row->rsize ? end + EDIT_HL_LOOKAHEAD : row->rsize;
+	editorHlLex(text, n, open, E.hl);
+
+	int color = 39;
+	int from = E.coloff;
+	int i;
+	for (i = E.coloff; i < end; i++)
+	{
+		int c = editorSyntaxToColor(E.hl[i]);
+		if (c == color)
+			continue;
+		abAppend(ab, &text[from], i - from);
+		char buf[16];
+		int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", c);
+		abAppend(ab, buf, clen);
+		color = c;
+		from = i;
+	}
+	abAppend(ab, &text[from], end - from);
+	if (color != 39)
+		abAppend(ab, "\x1b[39m", 5);
 }
 
 /**
  * Renders each row of the editor
  * @param ab: Append buffer for building output
  * Handles:
+ * - Skipping lines that are not damaged
  * - Drawing file contents
  * - Welcome message when buffer is empty
  * - Tilde markers for lines past end of file
@@ -673,11 +6844,19 @@ void editorScroll()
  */
 void editorDrawRows(struct abuf *ab)
 {
+	struct abuf *line = E.line;
 	int y;
 	for (y = 0; y < E.screenrows; y++)
 	{
 		int filerow = y + E.rowoff;
-		if (filerow >= E.numrows)
+		erow *row = filerow < E.numrows ? editorRowAt(filerow) : NULL;
+		// lines above the first damaged one only need redrawing if their row
+		// changed or the line was never drawn (an empty shadow)
+		if (y < E.redraw_from && !(row && (row->flags & ROW_DAMAGED)) && E.shadow[y].len)
+			continue;
+
+		line->len = 0;
+		if (row == NULL)
 		{
 			if (E.numrows == 0 && y == E.screenrows / 3)
 			{
@@ -689,100 +6868,257 @@ void editorDrawRows(struct abuf *ab)
 				int padding = (E.screencols - welcomelen) / 2;
 				if (padding)
 				{
-					abAppend(ab, "~", 1);
+					abAppend(line, "~", 1);
 					padding--;
 				}
-				while (padding--)
-					abAppend(ab, " ", 1);
-				abAppend(ab, welcome, welcomelen);
+				abFill(line, ' ', padding);
+				abAppend(line, welcome, welcomelen);
 			}
 			else
 			{
-				abAppend(ab, "~", 1);
+				abAppend(line, "~", 1);
 			}
 		}
 		else
 		{
-			int len = E.row[filerow].rsize - E.coloff;
+			editorRowDraw(row, filerow);
+			row->flags &= ~ROW_DAMAGED;
+			int len = row->rsize - E.coloff;
 			if (len < 0)
 				len = 0;
 			// You'd ed a lot of the checks below, it is used to truncate the row if it is greater than the terminal column size
 			if (len > E.screencols)
 				len = E.screencols;
-			abAppend(ab, &E.row[filerow].render[E.coloff], len);
+			if (E.syntax && !W.active && len > 0)
+				editorDrawRowHighlighted(line, row, filerow, len);
+			else if (row->flags & ROW_TABS)
+				abAppend(line, &row->u.heap.render[E.coloff], len);
+			else
+				editorDrawRowChars(line, row, E.coloff, len);
 		}
-		abAppend(ab, "\x1b[K", 3);
-		abAppend(ab, "\r\n", 2);
+		abAppend(line, "\x1b[K", 3);
+		editorDrawLine(ab, y, line);
 	}
 }
 
 void editorDrawStatusBar(struct abuf *ab)
 {
 	abAppend(ab, "\x1b[7m", 4);
-	char status[80], rstatus[80];
-	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-										 E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+	char status[80], rstatus[80], lines[24];
+	size_t covered = 0;
+	if (L.active)
+		covered = L.covered;
+	else if (W.active && !__atomic_load_n(&E.mapping->done, __ATOMIC_ACQUIRE))
+		covered = __atomic_load_n(&E.mapping->scanned, __ATOMIC_RELAXED);
+	if (covered || L.active)
+	{
+		// lines so far, scaled up by how much of the file they cover
+		double est = covered ? (double)E.numrows * E.maplen / covered : E.numrows;
+		snprintf(lines, sizeof(lines), "~%.0f", est);
+	}
+	else
+		snprintf(lines, sizeof(lines), "%d", E.numrows);
+	char which[32] = "";
+	if (V.n > 1)
+		snprintf(which, sizeof(which), "[%d/%d] ", V.current + 1, V.n);
+	int len = snprintf(status, sizeof(status), "%s%.20s - %s lines %s%s", which,
+										 E.filename ? E.filename : "[No Name]", lines,
+										 W.active ? "(read-only)" : E.dirty ? "(modified) " : "",
+										 T.active ? "(following)" : "");
+	int rlen;
+	if (F.active && F.depth > 0)
+	{
+		struct findLevel *lv = &F.levels[F.depth - 1];
+		if (lv->regex && !lv->re)
+			rlen = snprintf(rstatus, sizeof(rstatus), "regex: invalid");
+		else
+			rlen = snprintf(rstatus, sizeof(rstatus), "%s%ld matches%s", lv->regex ? "regex: " : "",
+											lv->matches, lv->done ? "" : " so far");
+	}
+	else if (P.hud)
+	{
+		char ns[16], bytes[16];
+		rlen = snprintf(rstatus, sizeof(rstatus), "frame %s %s, %lld dropped | %.1f sys/key | %d/%d",
+										editorPerfTime(ns, sizeof(ns), P.timers[PERF_REFRESH].last_ns),
+										editorPerfBytes(bytes, sizeof(bytes), P.frame_bytes), D.dropped, P.per_key, E.cy + 1,
+										E.numrows);
+	}
+	else
+	{
+		rlen = snprintf(rstatus, sizeof(rstatus), "%s | %ld blocks in %ld allocs | %d/%d",
+										E.syntax ? E.syntax->filetype : "no ft", H.blocks, H.nslabs + H.nlarge,
+										E.cy + 1, E.numrows);
+	}
 	if (len > E.screencols)
 		len = E.screencols;
 	abAppend(ab, status, len);
-	while (len < E.screencols)
+	if (len < E.screencols)
 	{
-		if (E.screencols - len == rlen)
+		// pad out to the screen width, right-aligning rstatus when it fits
+		if (E.screencols - len >= rlen)
 		{
+			abFill(ab, ' ', E.screencols - len - rlen);
 			abAppend(ab, rstatus, rlen);
-			break;
 		}
 		else
 		{
-			abAppend(ab, " ", 1);
-			len++;
+			abFill(ab, ' ', E.screencols - len);
 		}
 	}
 	abAppend(ab, "\x1b[m", 3);
-	abAppend(ab, "\r\n", 2);
 }
 
+/**
+ * Draws the status message while it is fresh
+ * With the perf overlay on, the last key, search and save times and the
+ * memory of the rows show in its place the rest of the time
+ */
 void editorDrawMessageBar(struct abuf *ab)
 {
 	abAppend(ab, "\x1b[K", 3);
 	int msglen = strlen(E.statusmsg);
 	if (msglen > E.screencols)
 		msglen = E.screencols;
-	if (msglen && time(NULL) - E.statusmsg_time < 5)
+	if (msglen && time(NULL) - E.statusmsg_time < EDIT_MESSAGE_SECS)
 		abAppend(ab, E.statusmsg, msglen);
+	else if (P.hud)
+	{
+		char hud[160], key[16], find[16], save[16], bg[16], rows[16], heap[16];
+		int len = snprintf(hud, sizeof(hud), "key %s | find %s | save %s+%s | rows %s heap %s | %lld allocs %ld live",
+											 editorPerfTime(key, sizeof(key), P.timers[PERF_KEY].last_ns),
+											 editorPerfTime(find, sizeof(find), P.timers[PERF_FIND].last_ns),
+											 editorPerfTime(save, sizeof(save), P.timers[PERF_SAVE].last_ns),
+											 editorPerfTime(bg, sizeof(bg), P.timers[PERF_SAVE_WRITE].last_ns),
+											 editorPerfBytes(rows, sizeof(rows), editorPerfRowBytes()),
+											 editorPerfBytes(heap, sizeof(heap), (long long)H.nslabs * EDIT_HEAP_SLAB), P.allocs,
+											 H.blocks);
+		if (len > E.screencols)
+			len = E.screencols;
+		abAppend(ab, hud, len);
+	}
 }
 
 /**
- * Main screen refresh function
- * Handles complete redraw of the editor screen
- * - Updates scroll position
- * - Hides cursor during redraw
- * - Clears screen and redraws all rows
- * - Positions cursor
- * - Shows cursor again
- * Uses append buffer for efficient terminal I/O
+ * Forgets the last frame so the next refresh redraws every line
+ * Also resizes the shadow frame when the window size changed
  */
-void editorRefreshScreen()
+void editorResetShadow()
+{
+	int y;
+	for (y = 0; E.shadow && y < E.drawn_rows + 2; y++)
+		abFree(&E.shadow[y]);
+	free(E.shadow);
+	E.shadow = calloc(E.screenrows + 2, sizeof(struct abuf));
+	E.drawn_rows = E.screenrows;
+	E.drawn_cols = E.screencols;
+	E.redraw_from = 0;
+}
+
+/**
+ * Builds the next frame in E.out, what the terminal needs to get from
+ * the last frame to this one
+ * Keeps a shadow copy of the last frame and only sends what changed
+ * With D.sync the frame is sent as one synchronized update
+ * - Updates scroll position, shifting the screen with a scroll region
+ *   when it moved by less than a screenful
+ * - Redraws damaged lines and sends those that differ from the shadow
+ * - Redraws the status and message bars the same way
+ * - Positions cursor, hiding it while lines are being rewritten
+ * A pure cursor movement sends nothing but the cursor position
+ * The output and line buffers live in E and are reused across frames
+ */
+void editorBuildFrame()
 {
+	if (E.shadow == NULL || E.drawn_rows != E.screenrows || E.drawn_cols != E.screencols)
+		editorResetShadow();
 	editorScroll();
-	struct abuf ab = ABUF_INIT;
+	editorHlSync(E.rowoff + E.screenrows);
+	struct abuf *ab = E.out;
+	ab->len = 0;
 
-	abAppend(&ab, "\x1b[?25l", 6);
-	abAppend(&ab, "\x1b[H", 3);
+	if (D.sync)
+		abAppend(ab, "\x1b[?2026h", 8);
+	abAppend(ab, "\x1b[?25l", 6);
+	int head = ab->len;
+	int delta = E.rowoff - E.drawn_rowoff;
+	if (delta && E.redraw_from > 0)
+		editorScrollRegion(ab, delta);
+	editorDrawRows(ab);
+	E.line->len = 0;
+	editorDrawStatusBar(E.line);
+	editorDrawLine(ab, E.screenrows, E.line);
+	E.line->len = 0;
+	editorDrawMessageBar(E.line);
+	editorDrawLine(ab, E.screenrows + 1, E.line);
 
-	editorDrawRows(&ab);
-	editorDrawStatusBar(&ab);
-	editorDrawMessageBar(&ab);
+	E.drawn_rowoff = E.rowoff;
+	E.drawn_coloff = E.coloff;
+	E.redraw_from = E.screenrows;
 
 	char buf[32];
 	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-	abAppend(&ab, buf, strlen(buf));
+	if (ab->len == head)
+	{
+		// nothing changed but the cursor
+		ab->len = 0;
+		abAppend(ab, buf, strlen(buf));
+		return;
+	}
+	abAppend(ab, buf, strlen(buf));
+	abAppend(ab, "\x1b[?25h", 6);
+	if (D.sync)
+		abAppend(ab, "\x1b[?2026l", 8);
+}
+
+/**
+ * Main screen refresh function, writes out editorBuildFrame()
+ */
+void editorRefreshScreen()
+{
+	EDIT_PERF_SCOPE(PERF_REFRESH);
+	editorBuildFrame();
+	write(STDOUT_FILENO, E.out->b, E.out->len);
+	P.frame_bytes = E.out->len;
+	P.bytes += E.out->len;
+	P.syscalls++;
+	if (P.keys > P.mark_keys)
+		P.per_key = (double)(P.syscalls - P.mark_syscalls) / (P.keys - P.mark_keys);
+	P.mark_syscalls = P.syscalls;
+	P.mark_keys = P.keys;
+}
 
-	abAppend(&ab, "\x1b[?25h", 6);
+/**
+ * Returns whether frames are capped and the next one is due, in which
+ * case it is drawn even with keys still waiting
+ */
+int editorFrameDue()
+{
+	return D.interval_ns && editorNowNs() - D.last_ns >= D.interval_ns;
+}
 
-	write(STDOUT_FILENO, ab.b, ab.len);
-	abFree(&ab);
+/**
+ * Draws a frame once the input that's waiting has been handled
+ * Frames are at least D.interval_ns apart: a key arriving before the
+ * next one is due returns 0 so the caller handles it first, and the
+ * frame that would have shown its predecessor is never drawn
+ * Without more input the next frame is drawn as soon as it's due, and
+ * with input that never lets up it is drawn when due all the same
+ * Returns 1 once it drew
+ */
+int editorFrame()
+{
+	if (!editorFrameDue() && editorKeyPending())
+		return 0;
+	long long left = D.last_ns + D.interval_ns - editorNowNs();
+	// a wake is left for editorReadKey(), which collects what it was for
+	if (left > 0 && editorInputWait((left + 999999) / 1000000, 0) == 1)
+	{
+		D.dropped++;
+		return 0;
+	}
+	D.last_ns = editorNowNs();
+	editorRefreshScreen();
+	return 1;
 }
 
 /*** input ***/
@@ -796,8 +7132,9 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
 	while (1)
 	{
 		editorSetStatusMessage(prompt, buf);
-		editorRefreshScreen();
+		editorFrame();
 		int c = editorReadKey();
+		editorPoll();
 		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
 		{
 			if (buflen != 0)
@@ -821,15 +7158,29 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
 				return buf;
 			}
 		}
-		else if (!iscntrl(c) && c < 128)
+		else if (c == PASTE_KEY || (!iscntrl(c) && c < 128))
 		{
-			if (buflen == bufsize - 1)
+			// pasted text is taken up to its first line break
+			size_t len = 1;
+			char *text = NULL;
+			char ch = c;
+			char *s = &ch;
+			if (c == PASTE_KEY)
+				s = text = editorReadPaste(&len);
+			size_t j;
+			for (j = 0; j < len && s[j] != '\r' && s[j] != '\n'; j++)
 			{
-				bufsize *= 2;
-				buf = realloc(buf, bufsize);
+				if (iscntrl((unsigned char)s[j]) || (unsigned char)s[j] >= 128)
+					continue;
+				if (buflen == bufsize - 1)
+				{
+					bufsize *= 2;
+					buf = realloc(buf, bufsize);
+				}
+				buf[buflen++] = s[j];
 			}
-			buf[buflen++] = c;
 			buf[buflen] = '\0';
+			free(text);
 		}
 
 		if (callback)
@@ -845,7 +7196,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
  */
 void editorMoveCursor(int key)
 {
-	erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
 	switch (key)
 	{
@@ -857,7 +7208,7 @@ void editorMoveCursor(int key)
 		else if (E.cy > 0)
 		{
 			E.cy--;
-			E.cx = E.row[E.cy].size;
+			E.cx = editorRowAt(E.cy)->size;
 		}
 		break;
 	case ARROW_RIGHT:
@@ -865,7 +7216,7 @@ void editorMoveCursor(int key)
 		{
 			E.cx++;
 		}
-		else if (row && E.cx == row->size)
+		else if (row && E.cx == row->size && E.cy < editorLastRow())
 		{
 			E.cy++;
 			E.cx = 0;
@@ -878,7 +7229,8 @@ void editorMoveCursor(int key)
 		}
 		break;
 	case ARROW_DOWN:
-		if (E.cx < E.numrows)
+		editorLoadUntil(E.cy + 2);
+		if (E.cy < editorLastRow())
 		{
 			E.cy++;
 		}
@@ -888,7 +7240,7 @@ void editorMoveCursor(int key)
 		break;
 	}
 
-	row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 	int rowlen = row ? row->size : 0;
 	if (E.cx > rowlen)
 	{
@@ -896,6 +7248,22 @@ void editorMoveCursor(int key)
 	}
 }
 
+/**
+ * Picks up what the save, the huge-file indexer, the loader and follow
+ * mode did in the background since the last call
+ */
+void editorPoll()
+{
+	// the search workers read the rows as they are, so nothing changes
+	// them before the scan is done, and its end wakes the editor again
+	if (editorFindBusy())
+		return;
+	editorSavePoll();
+	editorHugePoll();
+	editorLoadPoll();
+	editorFollowPoll();
+}
+
 /**
  * Main input handling function
  * Reads and processes each keypress
@@ -911,6 +7279,11 @@ void editorProcessKeypress()
 	static int quit_times = EDIT_QUIT_TIMES;
 
 	int c = editorReadKey();
+	editorPoll();
+	if (c == IDLE_KEY)
+		return;
+	EDIT_PERF_SCOPE(PERF_KEY);
+	P.keys++;
 
 	switch (c)
 	{
@@ -919,14 +7292,15 @@ void editorProcessKeypress()
 		break;
 
 	case CTRL_KEY('q'):
-		if (E.dirty && quit_times > 0)
+		if (editorBufferDirty() && quit_times > 0)
 		{
-			editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+			editorSetStatusMessage("WARNING!!! %s unsaved changes. "
 														 "Press Ctrl-Q %d more times to quit.",
-														 quit_times);
+														 E.dirty ? "File has" : "Another buffer has", quit_times);
 			quit_times--;
 			return;
 		}
+		editorSaveWait();
 		write(STDOUT_FILENO, "\x1b[2J", 4);
 		write(STDOUT_FILENO, "\x1b[H", 3);
 		exit(0);
@@ -936,13 +7310,69 @@ void editorProcessKeypress()
 		editorSave();
 		break;
 
+	case CTRL_KEY('z'):
+		editorUndo();
+		break;
+
+	case CTRL_KEY('t'):
+		if (T.active)
+		{
+			editorFollowStop();
+			editorSetStatusMessage("Stopped following");
+		}
+		else
+			editorFollowStart();
+		break;
+
+	case CTRL_KEY('y'):
+		editorRedo();
+		break;
+
+	case CTRL_KEY('p'):
+		P.hud = !P.hud;
+		break;
+
+	case CTRL_KEY('o'):
+	{
+		char *path = editorPrompt("Open: %s (ESC to cancel)", NULL);
+		if (path)
+			editorBufferOpen(path);
+		free(path);
+	}
+	break;
+
+	case CTRL_KEY('n'):
+		editorBufferSwitch((V.current + 1) % V.n);
+		break;
+
+	case CTRL_KEY('w'):
+		if (E.dirty && quit_times > 0)
+		{
+			editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+														 "Press Ctrl-W %d more times to close it.",
+														 quit_times);
+			quit_times--;
+			return;
+		}
+		editorBufferClose();
+		break;
+
+	case PASTE_KEY:
+	{
+		size_t len;
+		char *text = editorReadPaste(&len);
+		editorInsertText(text, len);
+		free(text);
+	}
+	break;
+
 	case HOME_KEY:
 		E.cx = 0;
 		break;
 
 	case END_KEY:
 		if (E.cy < E.numrows)
-			E.cx = E.row[E.cy].size;
+			E.cx = editorRowAt(E.cy)->size;
 		break;
 
 	case CTRL('F'):
@@ -966,9 +7396,11 @@ void editorProcessKeypress()
 		}
 		else if (c == PAGE_DOWN)
 		{
+			// a page past the one shown, once the loader has got that far
 			E.cy = E.rowoff + E.screenrows - 1;
-			if (E.cy > E.numrows)
-				E.cy = E.numrows;
+			editorLoadUntil(E.cy + E.screenrows + 1);
+			if (E.cy > editorLastRow())
+				E.cy = editorLastRow();
 		}
 
 		int times = E.screenrows;
@@ -998,17 +7430,320 @@ void editorProcessKeypress()
 	quit_times = EDIT_QUIT_TIMES;
 }
 
+/*** benchmarks ***/
+
+/**
+ * Writes line k of corpus c to buf, returning its length
+ * @param seed: Carried from line to line, so a corpus is one sequence
+ */
+int editorBenchLine(struct benchCorpus *c, long long k, unsigned *seed, char *buf)
+{
+	*seed = *seed * 1103515245 + 12345;
+	unsigned r = *seed >> 8;
+	int len = 0;
+	switch (c - BENCH_CORPORA)
+	{
+	case 0:
+	{
+		// 64 to 256 KB of words, with the odd needle
+		int target = (64 << 10) + r % (192 << 10);
+		while (len < target)
+		{
+			*seed = *seed * 1103515245 + 12345;
+			r = *seed >> 8;
+			if (r % 997 == 0)
+				len += sprintf(&buf[len], "needle ");
+			else
+			{
+				int w = 1 + r % 9, i;
+				for (i = 0; i < w; i++)
+					buf[len++] = 'a' + (r >> (i * 2)) % 26;
+				buf[len++] = ' ';
+			}
+		}
+		break;
+	}
+	case 1:
+	{
+		// indented code, with tabs inside the lines too
+		int depth = r % 5, i;
+		for (i = 0; i < depth; i++)
+			buf[len++] = '\t';
+		if (r % 13 == 0)
+			len += sprintf(&buf[len], "/* block %u\t*/", r % 1000);
+		else
+			len += sprintf(&buf[len], "if (count == %u)\treturn \"s%u\";\t// %lld", r % 10, r % 100, k % 1000);
+		break;
+	}
+	case 2:
+	{
+		int n = 1 + r % 12, i;
+		for (i = 0; i < n; i++)
+			buf[len++] = 'a' + (r >> (i * 2)) % 26;
+		break;
+	}
+	default:
+		len = sprintf(buf, "2026-10-14 %02lld:%02lld:%02lld.%03u %s [worker-%u] GET /api/items/%u %u took %ums",
+									(k / 3600000) % 24, (k / 60000) % 60, (k / 1000) % 60, r % 1000,
+									r % 17 == 0 ? "WARN" : "INFO", r % 32, r % 100000, r % 31 == 0 ? 500 : 200, r % 300);
+		break;
+	}
+	return len;
+}
+
+/**
+ * Writes corpus c at the given scale to path
+ * Returns the bytes written, or -1
+ */
+long long editorBenchWrite(struct benchCorpus *c, const char *path, double scale)
+{
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+	char *buf = malloc(EDIT_SAVE_JOIN + 256);
+	long long lines = c->lines * scale, bytes = c->bytes * scale, size = 0, k;
+	unsigned seed = 1;
+	for (k = 0; c->lines ? k < lines : size < bytes; k++)
+	{
+		int len = editorBenchLine(c, k, &seed, buf);
+		buf[len++] = '\n';
+		fwrite(buf, 1, len, fp);
+		size += len;
+	}
+	free(buf);
+	return fclose(fp) == 0 ? size : -1;
+}
+
+/**
+ * Waits a little for background work to report, as the main loop does
+ */
+void editorBenchWait()
+{
+	struct pollfd fd = {E.wake[0], POLLIN, 0};
+	poll(&fd, 1, 1);
+	char buf[64];
+	while (read(E.wake[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+void editorBenchPut(const char *key, long long value, int *n)
+{
+	printf("%s\n      \"%s\": %lld", (*n)++ ? "," : "", key, value);
+}
+
+/**
+ * Types a query into the search and waits for the workers to finish it
+ */
+void editorBenchFindKey(char *query, int key)
+{
+	editorFindCallback(query, key);
+	while (editorFindBusy())
+	{
+		editorBenchWait();
+		editorFindCallback(query, IDLE_KEY);
+	}
+}
+
+/**
+ * Runs every benchmark on the file at path, printing them as members of
+ * a JSON object. Times are in ns, averaged over the repeats
+ */
+void editorBenchFile(struct benchCorpus *c, const char *path, long long size)
+{
+	int n = 0;
+	editorBenchPut("bytes", size, &n);
+
+	long long t = editorNowNs();
+	editorOpen((char *)path);
+	editorBenchPut("open_ns", editorNowNs() - t, &n);
+	editorLoadUntil(INT_MAX);
+	while (W.active && !__atomic_load_n(&E.mapping->done, __ATOMIC_ACQUIRE))
+		editorBenchWait();
+	editorPoll();
+	editorBenchPut("load_ns", editorNowNs() - t, &n);
+	editorBenchPut("lines", E.numrows, &n);
+
+	// full redraws spread over the file, then paging down from the top
+	int k, reps = 16;
+	long long ns = 0, bytes = 0;
+	for (k = 0; k < reps; k++)
+	{
+		E.cy = E.rowoff = (long long)E.numrows * k / reps;
+		E.cx = 0;
+		editorResetShadow();
+		t = editorNowNs();
+		editorBuildFrame();
+		ns += editorNowNs() - t;
+		bytes += E.out->len;
+	}
+	editorBenchPut("frame_full_ns", ns / reps, &n);
+	editorBenchPut("frame_full_bytes", bytes / reps, &n);
+	E.cy = E.rowoff = 0;
+	editorBuildFrame();
+	reps = 256;
+	ns = bytes = 0;
+	for (k = 0; k < reps; k++)
+	{
+		E.cy = E.cy + E.screenrows < E.numrows ? E.cy + E.screenrows : E.numrows;
+		t = editorNowNs();
+		editorBuildFrame();
+		ns += editorNowNs() - t;
+		bytes += E.out->len;
+	}
+	editorBenchPut("frame_page_ns", ns / reps, &n);
+	editorBenchPut("frame_page_bytes", bytes / reps, &n);
+
+	// the query typed key by key, then walking the matches
+	E.cy = E.cx = E.rowoff = E.coloff = 0;
+	editorFindBegin();
+	F.active = 1;
+	char query[64] = "";
+	int qlen = 0;
+	t = editorNowNs();
+	while (c->query[qlen])
+	{
+		query[qlen] = c->query[qlen];
+		query[++qlen] = '\0';
+		editorBenchFindKey(query, query[qlen - 1]);
+	}
+	editorBenchPut("find_ns", editorNowNs() - t, &n);
+	editorBenchPut("find_matches", F.levels[F.depth - 1].matches, &n);
+	reps = 100;
+	t = editorNowNs();
+	for (k = 0; k < reps; k++)
+		editorBenchFindKey(query, ARROW_RIGHT);
+	editorBenchPut("find_next_ns", (editorNowNs() - t) / reps, &n);
+	editorFindCallback(query, '\r');
+
+	// a regex whose matches run on through the row, typed the same way
+	E.cy = E.cx = E.rowoff = E.coloff = 0;
+	editorFindBegin();
+	F.regex = 1;
+	qlen = 0;
+	t = editorNowNs();
+	while (c->regex[qlen])
+	{
+		query[qlen] = c->regex[qlen];
+		query[++qlen] = '\0';
+		editorBenchFindKey(query, query[qlen - 1]);
+	}
+	editorBenchPut("find_regex_ns", editorNowNs() - t, &n);
+	editorBenchPut("find_regex_matches", F.levels[F.depth - 1].matches, &n);
+	editorFindCallback(query, '\r');
+	F.regex = 0;
+	F.active = 0;
+
+	if (!W.active)
+	{
+		// typing storms in the middle of the file, into a row that was
+		// drawn so a tab row's render is patched key by key
+		E.cy = E.numrows / 2;
+		E.cx = 0;
+		E.rowoff = E.coloff = 0;
+		if (E.cy < E.numrows)
+			editorRowRender(editorRowAt(E.cy));
+		reps = 100000;
+		t = editorNowNs();
+		for (k = 0; k < reps; k++)
+			editorInsertChar('a' + k % 26);
+		editorBenchPut("type_char_ns", (editorNowNs() - t) / reps, &n);
+		E.cy = E.numrows / 3;
+		E.cx = 0;
+		reps = 2000;
+		ns = bytes = 0;
+		for (k = 0; k < reps; k++)
+		{
+			t = editorNowNs();
+			editorInsertChar(k % 7 ? 'a' + k % 26 : ' ');
+			editorBuildFrame();
+			ns += editorNowNs() - t;
+			bytes += E.out->len;
+		}
+		editorBenchPut("keystroke_frame_ns", ns / reps, &n);
+		editorBenchPut("keystroke_frame_bytes", bytes / reps, &n);
+		reps = 10000;
+		t = editorNowNs();
+		for (k = 0; k < reps; k++)
+			editorInsertNewline();
+		editorBenchPut("type_newline_ns", (editorNowNs() - t) / reps, &n);
+		unsigned seed = 7;
+		t = editorNowNs();
+		for (k = 0; k < reps; k++)
+		{
+			seed = seed * 1103515245 + 12345;
+			editorInsertRow((seed >> 8) % (E.numrows + 1), "\tinserted row", 13);
+		}
+		editorBenchPut("insert_row_ns", (editorNowNs() - t) / reps, &n);
+
+		t = editorNowNs();
+		editorSave();
+		editorSaveWait();
+		editorBenchPut("save_ns", editorNowNs() - t, &n);
+		E.cy = E.numrows / 2;
+		E.cx = 0;
+		editorInsertChar('x');
+		t = editorNowNs();
+		editorSave();
+		editorSaveWait();
+		editorBenchPut("save_edit_ns", editorNowNs() - t, &n);
+	}
+}
+
+/**
+ * Runs the benchmark suite headless and prints the results as JSON, for
+ * edit --bench [scale]
+ * Each corpus is written to a temporary directory first; the scale
+ * multiplies their sizes, which at 1 include 10M short lines and a
+ * 2 GB log. The keys stay the same from commit to commit, one to a
+ * line, so that two runs can be diffed
+ */
+int editorBench(double scale)
+{
+	char dir[PATH_MAX];
+	const char *tmp = getenv("TMPDIR");
+	snprintf(dir, sizeof(dir), "%s/edit-bench-XXXXXX", tmp ? tmp : "/tmp");
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	editorInitHeadless(EDIT_BENCH_ROWS, EDIT_BENCH_COLS);
+
+	printf("{\n  \"version\": \"%s\",\n  \"kernels\": \"%s\",\n  \"scale\": %g,\n", EDIT_VERSION, B->name,
+				 scale);
+	printf("  \"screen\": [%d, %d],\n  \"corpora\": {", EDIT_BENCH_ROWS, EDIT_BENCH_COLS);
+	unsigned int j;
+	for (j = 0; j < BENCH_CORPORA_ENTRIES; j++)
+	{
+		struct benchCorpus *c = &BENCH_CORPORA[j];
+		char path[PATH_MAX + 32];
+		snprintf(path, sizeof(path), "%s/%s", dir, c->name);
+		fprintf(stderr, "edit --bench: %s\n", c->name);
+		long long size = editorBenchWrite(c, path, scale);
+		if (size < 0)
+		{
+			perror(path);
+			return 1;
+		}
+		printf("%s\n    \"%s\": {", j ? "," : "", c->name);
+		editorBenchFile(c, path, size);
+		printf("\n    }");
+		fflush(stdout);
+		editorCloseFile();
+		unlink(path);
+	}
+	printf("\n  }\n}\n");
+	rmdir(dir);
+	return 0;
+}
+
 /*** init ***/
 
 /**
- * Initializes the editor state
- * - Resets cursor position
- * - Initializes row offset
- * - Gets terminal window size
- * - Initializes empty text buffer
- * Called once at program start
+ * Empties the buffer state, E's part of it and H, U, W, L, T and R
+ * Whatever they held must have been freed or put aside first
  */
-void initEditor()
+void editorInitBuffer()
 {
 	E.cx = 0;
 	E.cy = 0;
@@ -1016,20 +7751,107 @@ void initEditor()
 	E.rowoff = 0;
 	E.coloff = 0;
 	E.numrows = 0;
+	E.store = &flatStore;
+	E.rowcap = 0;
 	E.row = NULL;
+	E.rope = NULL;
+	E.rope_nodes = 0;
+	E.rope_hit = NULL;
+	E.gaprow = -1;
 	E.dirty = 0;
+	E.ndirty = 0;
 	E.filename = NULL;
+	E.map = NULL;
+	E.maplen = 0;
+	E.mapping = NULL;
+	E.map_exact = 0;
+	E.syntax = NULL;
+	E.hl_rows = 0;
+	E.hl_lo = INT_MAX;
+	E.hl_hi = 0;
+	E.hl = NULL;
+	E.hl_text = NULL;
+	E.hl_cap = 0;
+	memset(&H, 0, sizeof(H));
+	memset(&U, 0, sizeof(U));
+	U.last = -1;
+	memset(&W, 0, sizeof(W));
+	memset(&L, 0, sizeof(L));
+	memset(&T, 0, sizeof(T));
+	memset(R.rows, -1, sizeof(R.rows));
+	R.next = 0;
+}
+
+/**
+ * Sets the editor up without a terminal, for rows by cols of text
+ * This is all the headless API needs: editorOpen(), the editing and
+ * find functions, editorSave() and editorBuildFrame() then work as
+ * they do under the terminal, see editorBench()
+ */
+void editorInitHeadless(int rows, int cols)
+{
+	editorPickKernels();
+	F.job_level = -1;
+	editorInitBuffer();
+	V.cap = 4;
+	V.buffers = malloc(V.cap * sizeof(struct editorBuffer));
+	V.n = 1;
+	V.current = 0;
+	E.shadow = NULL;
+	E.out = calloc(1, sizeof(struct abuf));
+	E.line = calloc(1, sizeof(struct abuf));
+	E.drawn_rows = E.drawn_cols = 0;
+	E.drawn_rowoff = E.drawn_coloff = 0;
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
+	E.screenrows = rows;
+	E.screencols = cols;
 
-	if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+	if (pipe2(E.wake, O_NONBLOCK | O_CLOEXEC) == -1)
+		die("pipe");
+	E.winch = 0;
+}
+
+/**
+ * Initializes the editor state
+ * - Gets terminal window size
+ * - Sets up the state, see editorInitHeadless()
+ * - Caps the frame rate at EDIT_FPS, 0 for no cap, and sends frames as
+ *   synchronized updates unless EDIT_SYNC is 0
+ * - Handles resizes
+ * Called once at program start
+ */
+void initEditor()
+{
+	int rows, cols;
+	if (getWindowSize(&rows, &cols) == -1)
 		die("getWindowSize");
+	editorInitHeadless(rows - 2, cols);
+	P.log = getenv("EDIT_PERF_LOG");
+	if (P.log)
+		atexit(editorPerfDump);
+	char *fps = getenv("EDIT_FPS");
+	int rate = fps ? atoi(fps) : EDIT_FRAME_RATE;
+	D.interval_ns = rate > 0 ? 1000000000LL / rate : 0;
+	char *sync = getenv("EDIT_SYNC");
+	D.sync = !sync || strcmp(sync, "0") != 0;
 
-	E.screenrows -= 2;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = editorHandleWinch;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGWINCH, &sa, NULL);
 }
 
 int main(int argc, char *argv[])
 {
+	if (argc >= 2 && strcmp(argv[1], "--bench-kernels") == 0)
+	{
+		editorPickKernels();
+		return editorBenchKernels();
+	}
+	if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+		return editorBench(argc >= 3 ? atof(argv[2]) : 1);
 	enableRawMode();
 	initEditor();
 	if (argc >= 2)
@@ -1037,13 +7859,20 @@ int main(int argc, char *argv[])
 		editorOpen(argv[1]);
 	}
 
-	editorSetStatusMessage(
-			"HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+	// a message is cut at the size of E.statusmsg, so keep this in 79
+	editorSetStatusMessage("HELP: ^S save ^Q quit ^F find ^Z/Y undo/redo ^T follow ^O/N/W buffers ^P perf");
 
 	while (1)
 	{
-		editorRefreshScreen();
-		editorProcessKeypress();
+		editorFrame();
+		// keys that arrived together, like a burst of typing or a paste
+		// without brackets, are all handled before the next frame unless
+		// it comes due first
+		do
+		{
+			editorProcessKeypress();
+			editorScroll();
+		} while (editorKeyPending() && !editorFrameDue());
 	}
 
 	return 0;